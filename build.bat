@@ -7,6 +7,9 @@ set linker_flags=-incremental:no
 if not exist build mkdir build
 pushd build
 
-cl %compiler_flags% -TC ..\tiny_gb.c /link /out:tiny_gb.exe %linker_flags% kernel32.lib user32.lib gdi32.lib comdlg32.lib /subsystem:windows /ENTRY:mainCRTStartup
+cl %compiler_flags% -TC ..\tiny_gb.c ..\gb.c ..\pacer.c /link /out:tiny_gb.exe %linker_flags% kernel32.lib user32.lib gdi32.lib comdlg32.lib winmm.lib /subsystem:windows /ENTRY:mainCRTStartup
+cl %compiler_flags% -TC ..\tiny_gb_headless.c ..\gb.c ..\pacer.c /link /out:tiny_gb_headless.exe %linker_flags% /subsystem:console
+cl %compiler_flags% -DGB_PERF_COUNTERS -TC ..\tiny_gb_headless.c ..\gb.c ..\pacer.c /link /out:tiny_gb_headless_perf.exe %linker_flags% /subsystem:console
+cl %compiler_flags% -TC ..\tiny_gb_batch.c ..\gb.c /link /out:tiny_gb_batch.exe %linker_flags% /subsystem:console
 
 popd
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+# compiler_flags="-O0 -g -std=c11 -Wall -Wextra -Werror -Wno-unused-parameter -Wno-type-limits"
+compiler_flags="-O2 -g -std=c11 -Wall -Wextra -Werror -Wno-unused-parameter -Wno-type-limits"
+compiler=${CC:-cc}
+
+mkdir -p build
+cd build
+
+$compiler $compiler_flags -pthread ../tiny_gb_headless.c ../gb.c ../pacer.c -lm -o tiny_gb_headless
+$compiler $compiler_flags -DGB_PERF_COUNTERS -pthread ../tiny_gb_headless.c ../gb.c ../pacer.c -lm -o tiny_gb_headless_perf
+$compiler $compiler_flags -pthread ../tiny_gb_batch.c ../gb.c -lm -o tiny_gb_batch
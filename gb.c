@@ -0,0 +1,3911 @@
+#include "gb.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define LOW(value) ((value) & 0xFF)
+#define HIGH(value) ((value >> 8) & 0xFF)
+#define COMBINE(high, low) (((high) << 8) | (low))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#define BSWAP64(value) _byteswap_uint64(value)
+#define ATOMIC_INCREMENT(value) _InterlockedIncrement(value)
+#define ATOMIC_DECREMENT(value) _InterlockedDecrement(value)
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#define BSWAP64(value) __builtin_bswap64(value)
+#define ATOMIC_INCREMENT(value) __atomic_add_fetch(value, 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_DECREMENT(value) __atomic_sub_fetch(value, 1, __ATOMIC_ACQ_REL)
+#endif
+
+#if defined(GB_PERF_COUNTERS)
+#include <time.h>
+#define PERF_ADD(counter, value) ((counter) += (value))
+#else
+#define PERF_ADD(counter, value)
+#endif
+#define PERF_COUNT(counter) PERF_ADD(counter, 1)
+
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(NO_SIMD)
+#define HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(NO_JIT)
+#define HAS_JIT 1
+#endif
+
+static const uint32_t gb_colors[] = { 0xFFE0F8D0, 0xFF88C070, 0xFF345856, 0xFF081820 };
+
+static void clear_pixels(uint8_t *framebuffer)
+{
+    memset(framebuffer, 0, SCREEN_W*SCREEN_H);
+}
+
+static void load_nintendo_logo(gameboy_t *gb)
+{
+    uint16_t *tiles = (uint16_t *)(gb->memory + 0x8000);
+    tiles[0] = 0;
+    tiles[1] = 0;
+    tiles[2] = 0;
+    tiles[3] = 0;
+    tiles[4] = 0;
+    tiles[5] = 0;
+    tiles[6] = 0;
+    tiles[7] = 0;
+    tiles += 8;
+
+    for(uint8_t i = 0; i < 24; i++)
+    {
+        cartridge_header_t *header = gb->cartridge_header;
+        uint8_t tile[] =
+        {
+            LOW(header->logo[i]),
+            HIGH(header->logo[i]),
+        };
+        for(int8_t j = 0; j < 2; j++)
+        {
+            for(int8_t k = 1; k >= 0; k--)
+            {
+                uint16_t line = 0;
+                for(int8_t l = 0; l < 4; l++)
+                {
+                    uint8_t bit = (tile[j] >> (k*4 + l)) & 0x1;
+                    line |= (bit*(0x3)) << (2*l);
+                }
+                tiles[0] = tiles[1] = line;
+                tiles += 2;
+            }
+        }
+    }
+
+    tiles[0] = 0x3C;
+    tiles[1] = 0x42;
+    tiles[2] = 0xB9;
+    tiles[3] = 0xA5;
+    tiles[4] = 0xB9;
+    tiles[5] = 0xA5;
+    tiles[6] = 0x42;
+    tiles[7] = 0x3C;
+
+    uint8_t *tilemap = gb->memory + 0x9800;
+    uint8_t id = 1;
+    for(uint8_t y = 8; y < 10; y++)
+    {
+        for(uint8_t x = 4; x < 16; x++)
+        {
+            tilemap[32*y + x] = id++;
+        }
+    }
+    tilemap[32*8 + 16] = 25;
+}
+
+static uint16_t rom_kib(gameboy_t *gb)
+{
+    uint16_t size = 32*(1 << gb->cartridge_header->rom_size);
+    return(size);
+}
+
+static uint16_t ram_kib(gameboy_t *gb)
+{
+    uint16_t size = 0;
+    switch(gb->cartridge_header->ram_size)
+    {
+        case 0x2: size = 8; break;
+        case 0x3: size = 32; break;
+        case 0x4: size = 128; break;
+        case 0x5: size = 64; break;
+    }
+    return(size);
+}
+
+static uint32_t battery_size(gameboy_t *gb)
+{
+    // MBC2 has 512 half bytes of RAM built in, the others declare their RAM in the header.
+    uint32_t size = 0;
+    switch(gb->cartridge_header->type)
+    {
+        case CARTRIDGE_TYPE_MBC2_BATTERY:
+        {
+            size = 512;
+            break;
+        }
+        case CARTRIDGE_TYPE_MBC1_RAM_BATTERY:
+        case CARTRIDGE_TYPE_ROM_RAM_BATTERY:
+        case CARTRIDGE_TYPE_MMM01_RAM_BATTERY:
+        case CARTRIDGE_TYPE_MBC3_TIMER_RAM_BATTERY:
+        case CARTRIDGE_TYPE_MBC3_RAM_BATTERY:
+        case CARTRIDGE_TYPE_MBC5_RAM_BATTERY:
+        case CARTRIDGE_TYPE_MBC5_RUMBLE_RAM_BATTERY:
+        case CARTRIDGE_TYPE_MBC7_SENSOR_RUMBLE_RAM_BATTERY:
+        case CARTRIDGE_TYPE_HUC3:
+        case CARTRIDGE_TYPE_HUC1_RAM_BATTERY:
+        {
+            size = MIN(1024*ram_kib(gb), MAX_RAM_SIZE);
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+    return(size);
+}
+
+static uint8_t battery_banks(gameboy_t *gb)
+{
+    uint32_t count = (battery_size(gb) + 0x1FFF)/0x2000;
+    uint8_t banks = (uint8_t)((1 << count) - 1);
+    return(banks);
+}
+
+// Battery backed banks that match the save file are written through the slow path, so the first
+// write to one of them marks it as changed and maps it for the fast path until the next save.
+#define SAVE_DELAY_FRAMES 60
+
+static void battery_changed(gameboy_t *gb, uint8_t bank)
+{
+    uint8_t bit = (uint8_t)(1 << bank);
+    if(gb->saved_banks & bit)
+    {
+        gb->saved_banks &= (uint8_t)~bit;
+        if(gb->save_delay == 0)
+            gb->save_delay = SAVE_DELAY_FRAMES;
+    }
+}
+
+// Every 256 byte page of the address space has a read and a write pointer. Plain memory is
+// accessed directly through them, a NULL page goes through the slow handlers which deal with
+// MBC/IO registers and locked regions. The pointers are updated whenever a bank switch or the
+// LCD mode changes what a page maps to. Every writable page also knows which page of the saved
+// state it belongs to, so writes can flag it for the next rewind snapshot. During OAM DMA the
+// bus switches to a table without any mapped pages, so starting and finishing a transfer
+// doesn't have to touch the page tables.
+static uint8_t *const locked_pages[256] = { 0 };
+
+static void map_pages(uint8_t **pages, uint8_t first, uint8_t last, uint8_t *base)
+{
+    for(uint16_t i = first; i <= last; i++)
+        pages[i] = (base ? (base + (i - first)*0x100) : NULL);
+}
+
+static uint16_t state_page(gameboy_t *gb, const uint8_t *address)
+{
+    // State pages are the upper half of the address space followed by the cartridge RAM.
+    uint16_t page = 0;
+    if(address >= gb->memory + 0x8000 && address < gb->memory + 0x10000)
+        page = (uint16_t)((address - gb->memory - 0x8000) >> 8);
+    else if(address >= gb->ram && address < gb->ram + MAX_RAM_SIZE)
+        page = (uint16_t)(0x80 + ((address - gb->ram) >> 8));
+    return(page);
+}
+
+static uint8_t *state_page_ptr(gameboy_t *gb, uint16_t page)
+{
+    uint8_t *result = ((page < 0x80) ? (gb->memory + 0x8000 + page*0x100) : (gb->ram + (page - 0x80)*0x100));
+    return(result);
+}
+
+static void map_write_pages(gameboy_t *gb, uint8_t first, uint8_t last, uint8_t *base)
+{
+    map_pages(gb->write_pages, first, last, base);
+    for(uint16_t i = first; i <= last; i++)
+        gb->write_dirty[i] = (base ? state_page(gb, base + (i - first)*0x100) : 0);
+}
+
+static void update_rom_pages(gameboy_t *gb)
+{
+    map_pages(gb->read_pages, 0x40, 0x7F, gb->rom_page);
+}
+
+static void update_vram_pages(gameboy_t *gb)
+{
+    // Tile data is always written through the slow path, which invalidates the tile cache.
+    uint8_t *vram = (gb->state.no_vram_access ? NULL : (gb->memory + 0x8000));
+    map_pages(gb->read_pages, 0x80, 0x9F, vram);
+    map_write_pages(gb, 0x80, 0x97, NULL);
+    map_write_pages(gb, 0x98, 0x9F, (vram ? (vram + 0x1800) : NULL));
+}
+
+static void update_ram_pages(gameboy_t *gb)
+{
+    map_pages(gb->read_pages, 0xA0, 0xBF, gb->ram_page);
+    bool saved = ((gb->saved_banks & (1 << gb->ram_bank)) != 0);
+    map_write_pages(gb, 0xA0, 0xBF, ((gb->state.ram && !saved) ? gb->ram_page : NULL));
+}
+
+static void update_oam_pages(gameboy_t *gb)
+{
+    map_pages(gb->read_pages, 0xFE, 0xFE, (gb->state.no_oam_access ? NULL : (gb->memory + 0xFE00)));
+}
+
+static void update_bus(gameboy_t *gb)
+{
+    gb->read_map = (gb->state.dma_transfer ? locked_pages : gb->read_pages);
+    gb->write_map = (gb->state.dma_transfer ? locked_pages : gb->write_pages);
+}
+
+static void protect_code_pages(gameboy_t *gb)
+{
+    // Work RAM pages holding translated code are written through the slow path, which drops the
+    // blocks a write lands in.
+    for(uint8_t i = 0; i < 0x20; i++)
+    {
+        if(gb->jit.code_pages & (1u << i))
+            map_write_pages(gb, (uint8_t)(0xC0 + i), (uint8_t)(0xC0 + i), NULL);
+    }
+}
+
+static void update_pages(gameboy_t *gb)
+{
+    map_pages(gb->read_pages, 0x00, 0x3F, gb->rom_banks[0]);
+    map_pages(gb->read_pages, 0xC0, 0xDF, (gb->memory + 0xC000));
+    map_pages(gb->read_pages, 0xE0, 0xFD, (gb->memory + 0xC000));
+    map_pages(gb->read_pages, 0xFF, 0xFF, NULL);
+    map_write_pages(gb, 0x00, 0x7F, NULL);
+    map_write_pages(gb, 0xC0, 0xDF, (gb->memory + 0xC000));
+    map_write_pages(gb, 0xE0, 0xFF, NULL);
+    protect_code_pages(gb);
+    update_rom_pages(gb);
+    update_vram_pages(gb);
+    update_ram_pages(gb);
+    update_oam_pages(gb);
+    update_bus(gb);
+}
+
+// Blocks are translated once they ran JIT_HOT_COUNT times. RAM blocks rewritten too often are
+// left to the interpreter for good, as are addresses where nothing could be translated.
+#define JIT_HOT_COUNT 8
+#define JIT_MAX_INVALIDATIONS 4
+#define JIT_NEVER UINT16_MAX
+#define JIT_EMPTY UINT32_MAX
+
+static bool is_code_byte(gameboy_t *gb, uint16_t address)
+{
+    bool result = (gb->jit.code_bits && (gb->jit.code_bits[address >> 3] & (1 << (address & 7))));
+    return(result);
+}
+
+static void mark_code_bytes(gameboy_t *gb, uint16_t start, uint16_t end, bool code)
+{
+    for(uint32_t i = start; i <= end; i++)
+    {
+        if(code)
+            gb->jit.code_bits[i >> 3] |= (uint8_t)(1 << (i & 7));
+        else
+            gb->jit.code_bits[i >> 3] &= (uint8_t)~(1 << (i & 7));
+    }
+}
+
+static void jit_flush(gameboy_t *gb)
+{
+    // The caller updates the pages afterwards.
+    jit_t *jit = &gb->jit;
+    if(jit->blocks)
+    {
+        for(uint32_t i = 0; i < JIT_BLOCKS; i++)
+            jit->blocks[i] = (jit_block_t){ .key = JIT_EMPTY };
+        memset(jit->page_blocks, 0xFF, sizeof(jit->page_blocks));
+        memset(jit->code_bits, 0, 0x10000/8);
+        jit->code_used = 0;
+        jit->code_pages = 0;
+        jit->exit = true;
+    }
+}
+
+static void jit_drop_ram_blocks(gameboy_t *gb)
+{
+    // Restoring the memory replaces whatever code was in RAM, the ROM blocks stay valid. The
+    // caller updates the pages afterwards.
+    jit_t *jit = &gb->jit;
+    if(jit->blocks)
+    {
+        for(uint32_t i = 0; i < JIT_BLOCKS; i++)
+        {
+            jit_block_t *block = &jit->blocks[i];
+            if(block->key != JIT_EMPTY && block->start >= 0xC000)
+                *block = (jit_block_t){ .key = block->key, .start = block->start };
+        }
+        memset(jit->page_blocks, 0xFF, sizeof(jit->page_blocks));
+        memset(jit->code_bits, 0, 0x10000/8);
+        jit->code_pages = 0;
+        jit->exit = true;
+    }
+}
+
+static void jit_invalidate(gameboy_t *gb, uint16_t address)
+{
+    // Drops every RAM block containing the written byte. Blocks are far shorter than a page, so
+    // only the ones starting on its page or the one before can. Their bytes are unmarked and
+    // then marked again for the blocks left that overlap them.
+    jit_t *jit = &gb->jit;
+    uint16_t first = address;
+    uint16_t last = address;
+    for(uint32_t page = HIGH(address) - 1u; page <= HIGH(address); page++)
+    {
+        uint16_t *link = &jit->page_blocks[page];
+        while(*link != JIT_NO_BLOCK)
+        {
+            jit_block_t *block = &jit->blocks[*link];
+            if(block->start <= address && block->end >= address)
+            {
+                first = MIN(first, block->start);
+                last = MAX(last, block->end);
+                block->code = NULL;
+                block->invalidations += 1;
+                block->hits = ((block->invalidations >= JIT_MAX_INVALIDATIONS) ? JIT_NEVER : 0);
+                *link = block->next;
+            }
+            else
+            {
+                link = &block->next;
+            }
+        }
+    }
+    mark_code_bytes(gb, first, last, false);
+    for(uint32_t page = HIGH(first) - 1u; page <= HIGH(last); page++)
+    {
+        for(uint16_t i = jit->page_blocks[page]; i != JIT_NO_BLOCK; i = jit->blocks[i].next)
+        {
+            jit_block_t *block = &jit->blocks[i];
+            if(block->start <= last && block->end >= first)
+                mark_code_bytes(gb, MAX(block->start, first), MIN(block->end, last), true);
+        }
+    }
+    jit->exit = true;
+}
+
+// DMA, the TIMA overflow and the LCD are driven by events scheduled at absolute cycle timestamps.
+// After every instruction only the nearest deadline has to be checked. Handlers run in event_e
+// order; a handler reschedules its event relative to its previous deadline so no cycles are lost.
+// DIV and TIMA are derived from the cycle counter whenever they are accessed, so a running timer
+// only costs an event when it overflows and a halted CPU can sleep through whole scanlines.
+#define NEVER UINT64_MAX
+
+static const uint16_t timer_clocks[] = { 1024, 16, 64, 256 };
+static const uint16_t lcd_mode_cycles[] = { 204, 456, 80, 172 };
+
+static void schedule(gameboy_t *gb, event_e event, uint64_t time)
+{
+    gb->cycles.events[event] = time;
+    gb->cycles.next_event = NEVER;
+    for(uint8_t i = 0; i < EVENT_COUNT; i++)
+        gb->cycles.next_event = MIN(gb->cycles.next_event, gb->cycles.events[i]);
+}
+
+static void sync_timer(gameboy_t *gb)
+{
+    uint64_t now = gb->cycles.now;
+    if(!gb->state.stop)
+        gb->timer->div = (uint8_t)((now - gb->cycles.div_base) >> 8);
+    if(gb->timer->control.enable)
+        gb->timer->counter = (uint8_t)((now - gb->cycles.timer_base)/timer_clocks[gb->timer->control.clock]);
+}
+
+static void start_timer(gameboy_t *gb)
+{
+    // timer_base is the (virtual) time at which TIMA was zero, cycles.tac the partial count.
+    uint16_t clock = timer_clocks[gb->timer->control.clock];
+    gb->cycles.timer_base = gb->cycles.now - gb->cycles.tac - (uint64_t)gb->timer->counter*clock;
+    schedule(gb, EVENT_TIMER, gb->cycles.timer_base + 256*clock);
+}
+
+static void update_timer(gameboy_t *gb, timer_control_t old_control)
+{
+    // TIMA keeps its partial count in cycles.tac while the timer is stopped.
+    if(old_control.enable)
+    {
+        uint16_t clock = timer_clocks[old_control.clock];
+        uint64_t elapsed = gb->cycles.now - gb->cycles.timer_base;
+        gb->timer->counter = (uint8_t)(elapsed/clock);
+        gb->cycles.tac = (uint16_t)(elapsed % clock);
+    }
+    if(gb->timer->control.enable)
+        start_timer(gb);
+    else
+        schedule(gb, EVENT_TIMER, NEVER);
+}
+
+// The APU is synchronized lazily as well. Channels only advance when a sound register is
+// accessed and at the end of every frame, a whole block of cycles at a time; blocks end at
+// the frame sequencer ticks, so the registers are constant within a block. With audio enabled
+// every change of a channel's output becomes a band limited step in the delta buffer, which
+// is integrated into samples once per frame. Without it the channels skip ahead in one go.
+#define FRAME_SEQUENCER_CYCLES 8192
+#define AUDIO_STEP (((uint64_t)AUDIO_SAMPLE_RATE << 32)/CLOCK_FREQUENCY)
+#define AUDIO_PHASE_SHIFT (32 - 5)
+#define AUDIO_FLUSH_SAMPLES 512
+#define AUDIO_HIGH_PASS 0.996f
+#define AUDIO_GAIN 32.0f
+
+// Bit n is the output of a square channel at duty position n.
+static const uint8_t duty_patterns[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+// Unused and write only bits of 0xFF10-0xFF3F read as 1.
+static const uint8_t apu_read_masks[0x30] =
+{
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF,
+    0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+static void init_audio_kernel(audio_t *audio)
+{
+    // Windowed sinc impulses for every sub-sample phase, cut off a little below Nyquist.
+    const float pi = 3.14159265f;
+    const float cutoff = 0.9f;
+    for(uint32_t phase = 0; phase < AUDIO_BLIP_PHASES; phase++)
+    {
+        float sum = 0.0f;
+        for(uint32_t i = 0; i < AUDIO_BLIP_WIDTH; i++)
+        {
+            float x = (float)i - (AUDIO_BLIP_WIDTH/2 - 1) - (float)phase/AUDIO_BLIP_PHASES;
+            float sinc = ((x == 0.0f) ? 1.0f : sinf(pi*cutoff*x)/(pi*cutoff*x));
+            float window = 0.42f + 0.5f*cosf(pi*x/(AUDIO_BLIP_WIDTH/2)) + 0.08f*cosf(2.0f*pi*x/(AUDIO_BLIP_WIDTH/2));
+            audio->kernel[phase][i] = sinc*window;
+            sum += sinc*window;
+        }
+        for(uint32_t i = 0; i < AUDIO_BLIP_WIDTH; i++)
+            audio->kernel[phase][i] /= sum;
+    }
+}
+
+static void reset_audio(audio_t *audio)
+{
+    memset(audio->deltas, 0, sizeof(audio->deltas));
+    memset(audio->levels, 0, sizeof(audio->levels));
+    audio->position = 0;
+    audio->sum[0] = audio->sum[1] = 0.0f;
+    audio->capacitor[0] = audio->capacitor[1] = 0.0f;
+}
+
+static uint16_t channel_register(uint8_t channel, uint8_t index)
+{
+    // All four channels have five registers NRx0-NRx4, starting at 0xFF10.
+    uint16_t result = (uint16_t)(0xFF10 + channel*5 + index);
+    return(result);
+}
+
+static uint16_t channel_frequency(gameboy_t *gb, uint8_t channel)
+{
+    uint16_t result = (uint16_t)(gb->memory[channel_register(channel, 3)] | ((gb->memory[channel_register(channel, 4)] & 0x07) << 8));
+    return(result);
+}
+
+static uint32_t channel_period(gameboy_t *gb, uint8_t channel)
+{
+    uint32_t period = 0;
+    if(channel == 3)
+    {
+        uint8_t nr43 = gb->memory[0xFF22];
+        period = (((nr43 & 0x07) ? (nr43 & 0x07)*16u : 8u) << (nr43 >> 4));
+    }
+    else
+    {
+        period = (2048u - channel_frequency(gb, channel))*((channel == 2) ? 2u : 4u);
+    }
+    return(period);
+}
+
+static bool channel_dac(gameboy_t *gb, uint8_t channel)
+{
+    bool result = ((channel == 2) ? ((gb->memory[0xFF1A] & 0x80) != 0) : ((gb->memory[channel_register(channel, 2)] & 0xF8) != 0));
+    return(result);
+}
+
+static uint8_t channel_output(gameboy_t *gb, uint8_t channel)
+{
+    apu_channel_t *ch = &gb->apu.channels[channel];
+    uint8_t output = 0;
+    if(ch->enabled)
+    {
+        if(channel == 2)
+        {
+            uint8_t code = ((gb->memory[0xFF1C] >> 5) & 0x03);
+            uint8_t sample = gb->memory[0xFF30 + ch->position/2];
+            sample = ((ch->position & 1) ? (sample & 0x0F) : (sample >> 4));
+            output = (code ? (uint8_t)(sample >> (code - 1)) : 0);
+        }
+        else if(channel == 3)
+        {
+            output = ((ch->lfsr & 1) ? 0 : ch->volume);
+        }
+        else
+        {
+            uint8_t duty = (gb->memory[channel_register(channel, 1)] >> 6);
+            output = (((duty_patterns[duty] >> ch->position) & 1) ? ch->volume : 0);
+        }
+    }
+    return(output);
+}
+
+static void emit_output(gameboy_t *gb, uint8_t channel, uint64_t time, const int32_t *gains)
+{
+    // Adds the step from the channel's previous level to its current one at the given time.
+    audio_t *audio = &gb->audio;
+    int32_t output = channel_output(gb, channel);
+    int32_t *levels = audio->levels[channel];
+    int32_t left = output*gains[0];
+    int32_t right = output*gains[1];
+    if(left != levels[0] || right != levels[1])
+    {
+        uint64_t position = audio->position + (time - gb->apu.time)*AUDIO_STEP;
+        uint32_t index = (uint32_t)(position >> 32);
+        const float *kernel = audio->kernel[(position >> AUDIO_PHASE_SHIFT) & (AUDIO_BLIP_PHASES - 1)];
+        float *left_deltas = audio->deltas[0] + index;
+        float *right_deltas = audio->deltas[1] + index;
+        float left_step = (float)(left - levels[0]);
+        float right_step = (float)(right - levels[1]);
+        for(uint32_t i = 0; i < AUDIO_BLIP_WIDTH; i++)
+        {
+            left_deltas[i] += left_step*kernel[i];
+            right_deltas[i] += right_step*kernel[i];
+        }
+        levels[0] = left;
+        levels[1] = right;
+    }
+}
+
+static void run_channel(gameboy_t *gb, uint8_t channel, uint64_t end, const int32_t *gains, bool emit)
+{
+    apu_channel_t *ch = &gb->apu.channels[channel];
+    if(!ch->enabled || ch->next_step > end)
+        return;
+
+    uint32_t period = channel_period(gb, channel);
+    if(channel == 3)
+    {
+        bool short_mode = ((gb->memory[0xFF22] & 0x08) != 0);
+        while(ch->next_step <= end)
+        {
+            uint16_t bit = ((ch->lfsr ^ (ch->lfsr >> 1)) & 1);
+            ch->lfsr = (uint16_t)((ch->lfsr >> 1) | (bit << 14));
+            if(short_mode)
+                ch->lfsr = (uint16_t)((ch->lfsr & ~0x40) | (bit << 6));
+            if(emit)
+                emit_output(gb, channel, ch->next_step, gains);
+            ch->next_step += period;
+        }
+    }
+    else
+    {
+        // A channel at volume 0 can't change its output, so it skips ahead like a muted one.
+        uint8_t mask = ((channel == 2) ? 31 : 7);
+        bool audible = ((channel == 2) ? ((gb->memory[0xFF1C] & 0x60) != 0) : (ch->volume != 0));
+        if(emit && audible)
+        {
+            while(ch->next_step <= end)
+            {
+                ch->position = ((ch->position + 1) & mask);
+                emit_output(gb, channel, ch->next_step, gains);
+                ch->next_step += period;
+            }
+        }
+        else
+        {
+            uint64_t steps = (end - ch->next_step)/period + 1;
+            ch->position = (uint8_t)((ch->position + steps) & mask);
+            ch->next_step += steps*period;
+        }
+    }
+}
+
+static uint16_t sweep_frequency(gameboy_t *gb, apu_channel_t *ch)
+{
+    // The sweep turns channel 1 off as soon as the next frequency would overflow.
+    uint8_t nr10 = gb->memory[0xFF10];
+    uint16_t delta = (uint16_t)(ch->shadow_frequency >> (nr10 & 0x07));
+    uint16_t frequency = (uint16_t)((nr10 & 0x08) ? (ch->shadow_frequency - delta) : (ch->shadow_frequency + delta));
+    if(frequency > 2047)
+        ch->enabled = 0;
+    return(frequency);
+}
+
+static void clock_sweep(gameboy_t *gb)
+{
+    apu_channel_t *ch = &gb->apu.channels[0];
+    uint8_t nr10 = gb->memory[0xFF10];
+    uint8_t period = ((nr10 >> 4) & 0x07);
+    if(ch->sweep_timer > 1)
+    {
+        ch->sweep_timer -= 1;
+        return;
+    }
+
+    ch->sweep_timer = (period ? period : 8);
+    if(ch->enabled && ch->sweep_enabled && period)
+    {
+        uint16_t frequency = sweep_frequency(gb, ch);
+        if(frequency <= 2047 && (nr10 & 0x07))
+        {
+            ch->shadow_frequency = frequency;
+            gb->memory[0xFF13] = LOW(frequency);
+            gb->memory[0xFF14] = (uint8_t)((gb->memory[0xFF14] & 0xF8) | HIGH(frequency));
+            sweep_frequency(gb, ch);
+        }
+    }
+}
+
+static void clock_frame_sequencer(gameboy_t *gb)
+{
+    // Lengths run at 256 Hz, the sweep at 128 Hz and the envelopes at 64 Hz.
+    apu_t *apu = &gb->apu;
+    uint8_t step = apu->frame_sequencer;
+    apu->frame_sequencer = ((step + 1) & 7);
+    if(!(gb->memory[0xFF26] & 0x80))
+        return;
+
+    if((step & 1) == 0)
+    {
+        for(uint8_t i = 0; i < 4; i++)
+        {
+            apu_channel_t *ch = &apu->channels[i];
+            if((gb->memory[channel_register(i, 4)] & 0x40) && ch->length > 0)
+            {
+                ch->length -= 1;
+                if(ch->length == 0)
+                    ch->enabled = 0;
+            }
+        }
+    }
+    if(step == 2 || step == 6)
+        clock_sweep(gb);
+    if(step == 7)
+    {
+        for(uint8_t i = 0; i < 4; i++)
+        {
+            apu_channel_t *ch = &apu->channels[i];
+            uint8_t envelope = gb->memory[channel_register(i, 2)];
+            if(i == 2 || !ch->enabled || (envelope & 0x07) == 0)
+                continue;
+            if(ch->envelope_timer > 1)
+            {
+                ch->envelope_timer -= 1;
+                continue;
+            }
+            ch->envelope_timer = (envelope & 0x07);
+            if((envelope & 0x08) && ch->volume < 15)
+                ch->volume += 1;
+            else if(!(envelope & 0x08) && ch->volume > 0)
+                ch->volume -= 1;
+        }
+    }
+}
+
+static void flush_audio(gameboy_t *gb)
+{
+    // Integrates all completed samples into the ring, removing the DC offset on the way like
+    // the capacitors on the real output do.
+    audio_t *audio = &gb->audio;
+    uint32_t count = (uint32_t)(audio->position >> 32);
+    uint32_t write = audio->write;
+    uint32_t space = AUDIO_RING_FRAMES - (write - atomic_load_u32(&audio->read));
+    for(uint32_t i = 0; i < count; i++)
+    {
+        for(uint32_t side = 0; side < 2; side++)
+        {
+            audio->sum[side] += audio->deltas[side][i];
+            float output = audio->sum[side] - audio->capacitor[side];
+            audio->capacitor[side] = audio->sum[side] - output*AUDIO_HIGH_PASS;
+            float sample = MIN(MAX(output*AUDIO_GAIN, -32768.0f), 32767.0f);
+            if(i < space)
+                audio->ring[(write + i) % AUDIO_RING_FRAMES][side] = (int16_t)sample;
+        }
+    }
+    atomic_store_u32(&audio->write, write + MIN(count, space));
+    PERF_ADD(gb->perf.audio_frames, count);
+
+    for(uint32_t side = 0; side < 2; side++)
+    {
+        float *deltas = audio->deltas[side];
+        memmove(deltas, deltas + count, AUDIO_BLIP_WIDTH*sizeof(float));
+        memset(deltas + AUDIO_BLIP_WIDTH, 0, count*sizeof(float));
+    }
+    audio->position -= ((uint64_t)count << 32);
+}
+
+static void sync_apu(gameboy_t *gb)
+{
+    apu_t *apu = &gb->apu;
+    uint64_t now = gb->cycles.now;
+    if(apu->time >= now)
+        return;
+    PERF_COUNT(gb->perf.apu_syncs);
+
+    while(apu->time < now)
+    {
+        // The frame sequencer is clocked by bit 12 of the DIV counter falling.
+        uint64_t frame_sequencer = apu->time + FRAME_SEQUENCER_CYCLES - ((apu->time - gb->cycles.div_base) % FRAME_SEQUENCER_CYCLES);
+        uint64_t end = MIN(now, frame_sequencer);
+
+        int32_t gains[4][2] = { 0 };
+        bool emit = gb->audio_enabled;
+        if(emit)
+        {
+            uint8_t nr50 = gb->memory[0xFF24];
+            uint8_t nr51 = gb->memory[0xFF25];
+            for(uint8_t i = 0; i < 4; i++)
+            {
+                gains[i][0] = ((nr51 & (0x10 << i)) ? ((nr50 >> 4) & 0x07) + 1 : 0);
+                gains[i][1] = ((nr51 & (0x01 << i)) ? (nr50 & 0x07) + 1 : 0);
+                emit_output(gb, i, apu->time, gains[i]);
+            }
+        }
+        for(uint8_t i = 0; i < 4; i++)
+            run_channel(gb, i, end, gains[i], emit);
+
+        if(emit)
+        {
+            gb->audio.position += (end - apu->time)*AUDIO_STEP;
+            if((gb->audio.position >> 32) >= AUDIO_FLUSH_SAMPLES)
+                flush_audio(gb);
+        }
+        apu->time = end;
+        if(end == frame_sequencer)
+            clock_frame_sequencer(gb);
+    }
+}
+
+static void trigger_channel(gameboy_t *gb, uint8_t channel)
+{
+    apu_channel_t *ch = &gb->apu.channels[channel];
+    uint8_t envelope = gb->memory[channel_register(channel, 2)];
+    ch->enabled = channel_dac(gb, channel);
+    if(ch->length == 0)
+        ch->length = ((channel == 2) ? 256 : 64);
+    ch->volume = (envelope >> 4);
+    ch->envelope_timer = (envelope & 0x07);
+    ch->next_step = gb->cycles.now + channel_period(gb, channel);
+    if(channel == 2)
+        ch->position = 0;
+    if(channel == 3)
+        ch->lfsr = 0x7FFF;
+    if(channel == 0)
+    {
+        uint8_t nr10 = gb->memory[0xFF10];
+        uint8_t period = ((nr10 >> 4) & 0x07);
+        ch->shadow_frequency = channel_frequency(gb, 0);
+        ch->sweep_timer = (period ? period : 8);
+        ch->sweep_enabled = (period || (nr10 & 0x07));
+        if(nr10 & 0x07)
+            sweep_frequency(gb, ch);
+    }
+}
+
+static void write_apu(gameboy_t *gb, uint16_t address, uint8_t value)
+{
+    sync_apu(gb);
+
+    // While the APU is off only NR52 and the wave RAM can be written.
+    bool power = ((gb->memory[0xFF26] & 0x80) != 0);
+    if(!power && address < 0xFF26)
+        return;
+
+    gb->memory[address] = value;
+    if(address >= 0xFF30)
+        return;
+
+    uint8_t channel = (uint8_t)((address - 0xFF10)/5);
+    uint8_t index = (uint8_t)((address - 0xFF10) % 5);
+    if(address == 0xFF26)
+    {
+        gb->memory[address] = (value & 0x80);
+        if(!(value & 0x80))
+        {
+            memset(gb->memory + 0xFF10, 0, 0x16);
+            memset(gb->apu.channels, 0, sizeof(gb->apu.channels));
+        }
+        else if(!power)
+        {
+            gb->apu.frame_sequencer = 0;
+        }
+    }
+    else if(address < 0xFF24)
+    {
+        apu_channel_t *ch = &gb->apu.channels[channel];
+        if(index == 1)
+            ch->length = (uint16_t)((channel == 2) ? (256 - value) : (64 - (value & 0x3F)));
+        else if((index == 2 && channel != 2) || (index == 0 && channel == 2))
+            ch->enabled = (ch->enabled && channel_dac(gb, channel));
+        else if(index == 4 && (value & 0x80))
+            trigger_channel(gb, channel);
+    }
+}
+
+static uint8_t read_apu(gameboy_t *gb, uint16_t address)
+{
+    uint8_t value = gb->memory[address];
+    if(address == 0xFF26)
+    {
+        sync_apu(gb);
+        for(uint8_t i = 0; i < 4; i++)
+            value |= (gb->apu.channels[i].enabled ? (1 << i) : 0);
+    }
+    if(address < 0xFF30)
+        value |= apu_read_masks[address - 0xFF10];
+    return(value);
+}
+
+uint32_t gb_audio_read(gameboy_t *gb, int16_t *samples, uint32_t count)
+{
+    audio_t *audio = &gb->audio;
+    uint32_t read = audio->read;
+    uint32_t available = atomic_load_u32(&audio->write) - read;
+    count = MIN(count, available);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        samples[2*i + 0] = audio->ring[(read + i) % AUDIO_RING_FRAMES][0];
+        samples[2*i + 1] = audio->ring[(read + i) % AUDIO_RING_FRAMES][1];
+    }
+    atomic_store_u32(&audio->read, read + count);
+    return(count);
+}
+
+uint32_t gb_audio_queued(gameboy_t *gb)
+{
+    uint32_t result = atomic_load_u32(&gb->audio.write) - atomic_load_u32(&gb->audio.read);
+    return(result);
+}
+
+static uint32_t file_size(FILE *file)
+{
+    // Sizes that don't fit are reported as UINT32_MAX, which is too large for anything loaded.
+    fseek(file, 0, SEEK_END);
+    long position = ftell(file);
+    uint32_t size = ((position >= 0 && (unsigned long)position < UINT32_MAX) ? (uint32_t)position : UINT32_MAX);
+    fseek(file, 0, SEEK_SET);
+    return(size);
+}
+
+static void load_ram(gameboy_t *gb, char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if(file)
+    {
+        // A file larger than any cartridge RAM isn't a save of this game and is ignored.
+        uint32_t size = file_size(file);
+        if(size <= MAX_RAM_SIZE)
+            fread(gb->ram, 1, size, file);
+        fclose(file);
+    }
+}
+
+static void restore_ram(gameboy_t *gb, const uint8_t *data, uint32_t size)
+{
+    for(uint32_t offset = 0; offset < size; offset += 0x2000)
+    {
+        if(memcmp(gb->ram + offset, data + offset, MIN(size - offset, 0x2000)) != 0)
+            battery_changed(gb, (uint8_t)(offset/0x2000));
+    }
+    memcpy(gb->ram, data, size);
+}
+
+// A save state is a header identifying the ROM and format, the machine state below, the upper
+// 32 KiB of the address space and the cartridge RAM. Everything else is either ROM or derived
+// from these (bank pointers, page tables), and the framebuffer is redrawn by the next frame.
+#define STATE_MAGIC 0x53424754
+
+typedef struct state_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint16_t global_checksum;
+    uint8_t checksum;
+    uint8_t reserved;
+} state_header_t;
+
+typedef struct machine_state_t
+{
+    registers_t registers;
+    state_t state;
+    cycles_t cycles;
+    apu_t apu;
+    uint32_t frames;
+    uint8_t rom_bank;
+    uint8_t ram_bank;
+    uint8_t num_scanline_sprites;
+    sprite_attribute_t scanline_sprites[MAX_SCANLINE_SPRITES];
+} machine_state_t;
+
+static uint32_t state_ram_size(gameboy_t *gb)
+{
+    uint32_t size = MIN(MAX(1024*ram_kib(gb), 0x2000), MAX_RAM_SIZE);
+    return(size);
+}
+
+static void save_machine(gameboy_t *gb, machine_state_t *machine)
+{
+    sync_apu(gb);
+    machine->registers = gb->registers;
+    machine->state = gb->state;
+    machine->cycles = gb->cycles;
+    machine->apu = gb->apu;
+    machine->frames = gb->frames;
+    machine->rom_bank = gb->rom_bank;
+    machine->ram_bank = gb->ram_bank;
+    machine->num_scanline_sprites = gb->num_scanline_sprites;
+    memcpy(machine->scanline_sprites, gb->scanline_sprites, sizeof(machine->scanline_sprites));
+}
+
+static void restore_memory(gameboy_t *gb, const uint8_t *data)
+{
+    // Restores the upper half of the address space. Only the tiles, sprites and translated code
+    // whose bytes actually change are invalidated, so rolling back to a nearly identical state
+    // keeps the caches.
+    for(uint32_t page = 0x80; page < 0x100; page++)
+    {
+        uint8_t *memory = gb->memory + page*0x100;
+        const uint8_t *source = data + (page - 0x80)*0x100;
+        if(memcmp(memory, source, 0x100) == 0)
+            continue;
+
+        for(uint32_t i = 0; i < 0x100; i++)
+        {
+            if(memory[i] != source[i])
+            {
+                uint16_t address = (uint16_t)(page*0x100 + i);
+                memory[i] = source[i];
+                if(address <= 0x97FF)
+                    gb->tile_dirty[(address - 0x8000)/16] = 1;
+                gb->oam_dirty |= (address >= 0xFE00 && address <= 0xFE9F);
+                if(is_code_byte(gb, address))
+                    jit_invalidate(gb, address);
+            }
+        }
+    }
+}
+
+static bool machine_valid(gameboy_t *gb, const machine_state_t *machine)
+{
+    // State files come from outside, every field used as an index or shift must be in range
+    // before anything is applied. The ROM bank can't be out of range with 256 bank pointers.
+    bool result = (machine->ram_bank < sizeof(gb->ram_banks)/sizeof(gb->ram_banks[0]) &&
+        machine->num_scanline_sprites <= MAX_SCANLINE_SPRITES);
+    for(uint8_t channel = 0; channel < 4; channel++)
+        result = (result && machine->apu.channels[channel].position <= ((channel == 2) ? 31 : 7));
+    return(result);
+}
+
+static void load_machine(gameboy_t *gb, machine_state_t *machine)
+{
+    // Only called after the memory was restored as well.
+    gb->registers = machine->registers;
+    gb->state = machine->state;
+    gb->cycles = machine->cycles;
+    gb->apu = machine->apu;
+    gb->frames = machine->frames;
+    gb->rom_bank = machine->rom_bank;
+    gb->ram_bank = machine->ram_bank;
+    gb->num_scanline_sprites = machine->num_scanline_sprites;
+    memcpy(gb->scanline_sprites, machine->scanline_sprites, sizeof(gb->scanline_sprites));
+
+    gb->rom_page = gb->rom_banks[MAX(gb->rom_bank, 1)];
+    gb->ram_page = gb->ram_banks[gb->ram_bank];
+    update_pages(gb);
+}
+
+size_t gb_state_size(gameboy_t *gb)
+{
+    size_t size = sizeof(state_header_t) + sizeof(machine_state_t) + 0x8000 + state_ram_size(gb);
+    return(size);
+}
+
+size_t gb_save_state(gameboy_t *gb, void *buffer, size_t size)
+{
+    size_t state_size = gb_state_size(gb);
+    if(size < state_size)
+        return(0);
+
+    uint8_t *data = buffer;
+    state_header_t *header = (state_header_t *)data;
+    header->magic = STATE_MAGIC;
+    header->version = STATE_VERSION;
+    header->size = (uint32_t)state_size;
+    header->global_checksum = gb->cartridge_header->global_checksum;
+    header->checksum = gb->cartridge_header->checksum;
+    header->reserved = 0;
+    data += sizeof(state_header_t);
+
+    machine_state_t machine;
+    memset(&machine, 0, sizeof(machine_state_t));
+    save_machine(gb, &machine);
+    memcpy(data, &machine, sizeof(machine_state_t));
+    data += sizeof(machine_state_t);
+
+    memcpy(data, gb->memory + 0x8000, 0x8000);
+    data += 0x8000;
+    memcpy(data, gb->ram, state_ram_size(gb));
+
+    return(state_size);
+}
+
+bool gb_load_state(gameboy_t *gb, const void *buffer, size_t size)
+{
+    const uint8_t *data = buffer;
+    state_header_t header;
+    if(size < sizeof(state_header_t))
+        return(false);
+    memcpy(&header, data, sizeof(state_header_t));
+    if(header.magic != STATE_MAGIC || header.version != STATE_VERSION ||
+        header.size != size || size != gb_state_size(gb) ||
+        header.global_checksum != gb->cartridge_header->global_checksum ||
+        header.checksum != gb->cartridge_header->checksum)
+    {
+        return(false);
+    }
+    data += sizeof(state_header_t);
+
+    machine_state_t machine;
+    memcpy(&machine, data, sizeof(machine_state_t));
+    data += sizeof(machine_state_t);
+    if(!machine_valid(gb, &machine))
+        return(false);
+
+    restore_memory(gb, data);
+    data += 0x8000;
+    restore_ram(gb, data, state_ram_size(gb));
+    memset(gb->dirty, 1, sizeof(gb->dirty));
+
+    load_machine(gb, &machine);
+    return(true);
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+    return(hash);
+}
+
+uint64_t gb_state_hash(gameboy_t *gb)
+{
+    // FNV-1a over the same data a save state contains.
+    sync_timer(gb);
+    machine_state_t machine;
+    memset(&machine, 0, sizeof(machine_state_t));
+    save_machine(gb, &machine);
+    uint64_t hash = 0xCBF29CE484222325;
+    hash = hash_bytes(hash, &machine, sizeof(machine_state_t));
+    hash = hash_bytes(hash, gb->memory + 0x8000, 0x8000);
+    hash = hash_bytes(hash, gb->ram, state_ram_size(gb));
+    return(hash);
+}
+
+// A rewind record holds the machine state at the time of the snapshot and the previous contents
+// of every page written since the snapshot before it. The shadow copy always holds the pages as
+// of the newest snapshot, so popping a record first undoes all writes since then and afterwards
+// moves the shadow one snapshot back. Records are framed by their size on both ends, the leading
+// one to drop the oldest record and the trailing one to find the newest.
+#define REWIND_PAGE_SIZE (sizeof(uint16_t) + 0x100)
+#define REWIND_RECORD_SIZE(pages) (2*sizeof(uint32_t) + sizeof(machine_state_t) + sizeof(uint16_t) + (pages)*REWIND_PAGE_SIZE)
+
+static void ring_write(rewind_t *rewind, const void *data, uint32_t size)
+{
+    uint32_t first = MIN(size, rewind->capacity - rewind->head);
+    memcpy(rewind->buffer + rewind->head, data, first);
+    memcpy(rewind->buffer, (const uint8_t *)data + first, size - first);
+    rewind->head = (rewind->head + size) % rewind->capacity;
+    rewind->used += size;
+}
+
+static void ring_read(rewind_t *rewind, uint32_t offset, void *data, uint32_t size)
+{
+    offset %= rewind->capacity;
+    uint32_t first = MIN(size, rewind->capacity - offset);
+    memcpy(data, rewind->buffer + offset, first);
+    memcpy((uint8_t *)data + first, rewind->buffer, size - first);
+}
+
+static void rewind_clear(gameboy_t *gb)
+{
+    rewind_t *rewind = &gb->rewind;
+    rewind->head = 0;
+    rewind->used = 0;
+    rewind->count = 0;
+    if(rewind->shadow)
+    {
+        memcpy(rewind->shadow, gb->memory + 0x8000, 0x8000);
+        memcpy(rewind->shadow + 0x8000, gb->ram, MAX_RAM_SIZE);
+    }
+    memset(gb->dirty, 0, sizeof(gb->dirty));
+}
+
+bool gb_rewind_init(gameboy_t *gb, uint32_t capacity)
+{
+    rewind_t *rewind = &gb->rewind;
+    free(rewind->buffer);
+    free(rewind->shadow);
+
+    // The ring has to fit at least one snapshot with every page written.
+    rewind->capacity = MAX(capacity, (uint32_t)REWIND_RECORD_SIZE(STATE_PAGES));
+    rewind->buffer = malloc(rewind->capacity);
+    rewind->shadow = malloc(0x8000 + MAX_RAM_SIZE);
+
+    bool result = (rewind->buffer && rewind->shadow);
+    if(!result)
+    {
+        free(rewind->buffer);
+        free(rewind->shadow);
+        *rewind = (rewind_t){ 0 };
+    }
+    rewind_clear(gb);
+    return(result);
+}
+
+void gb_rewind_push(gameboy_t *gb)
+{
+    rewind_t *rewind = &gb->rewind;
+    if(!rewind->buffer)
+        return;
+
+    // OAM and the IO registers are also written by the PPU, DMA and timers.
+    gb->dirty[0x7E] = 1;
+    gb->dirty[0x7F] = 1;
+
+    uint16_t pages = 0;
+    for(uint16_t i = 0; i < STATE_PAGES; i++)
+        pages += gb->dirty[i];
+
+    uint32_t size = REWIND_RECORD_SIZE(pages);
+    while(rewind->used + size > rewind->capacity)
+    {
+        uint32_t oldest = 0;
+        ring_read(rewind, rewind->head + rewind->capacity - rewind->used, &oldest, sizeof(uint32_t));
+        rewind->used -= oldest;
+        rewind->count -= 1;
+    }
+
+    machine_state_t machine;
+    save_machine(gb, &machine);
+    ring_write(rewind, &size, sizeof(uint32_t));
+    ring_write(rewind, &machine, sizeof(machine_state_t));
+    ring_write(rewind, &pages, sizeof(uint16_t));
+    for(uint16_t i = 0; i < STATE_PAGES; i++)
+    {
+        if(gb->dirty[i])
+        {
+            uint8_t *shadow = (rewind->shadow + i*0x100);
+            ring_write(rewind, &i, sizeof(uint16_t));
+            ring_write(rewind, shadow, 0x100);
+            memcpy(shadow, state_page_ptr(gb, i), 0x100);
+            gb->dirty[i] = 0;
+        }
+    }
+    ring_write(rewind, &size, sizeof(uint32_t));
+    rewind->count += 1;
+}
+
+bool gb_rewind_pop(gameboy_t *gb)
+{
+    rewind_t *rewind = &gb->rewind;
+    if(!rewind->buffer || rewind->count == 0)
+        return(false);
+
+    gb->dirty[0x7E] = 1;
+    gb->dirty[0x7F] = 1;
+    for(uint16_t i = 0; i < STATE_PAGES; i++)
+    {
+        if(gb->dirty[i])
+        {
+            memcpy(state_page_ptr(gb, i), (rewind->shadow + i*0x100), 0x100);
+            gb->dirty[i] = 0;
+            if(i >= 0x80)
+                battery_changed(gb, (uint8_t)((i - 0x80)/0x20));
+        }
+    }
+
+    uint32_t size = 0;
+    ring_read(rewind, rewind->head + rewind->capacity - sizeof(uint32_t), &size, sizeof(uint32_t));
+    uint32_t offset = rewind->head + rewind->capacity - size + sizeof(uint32_t);
+
+    machine_state_t machine;
+    uint16_t pages = 0;
+    ring_read(rewind, offset, &machine, sizeof(machine_state_t));
+    offset += sizeof(machine_state_t);
+    ring_read(rewind, offset, &pages, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+    for(uint16_t i = 0; i < pages; i++)
+    {
+        uint16_t page = 0;
+        ring_read(rewind, offset, &page, sizeof(uint16_t));
+        ring_read(rewind, offset + sizeof(uint16_t), (rewind->shadow + page*0x100), 0x100);
+        gb->dirty[page] = 1;
+        offset += REWIND_PAGE_SIZE;
+    }
+
+    rewind->head = (rewind->head + rewind->capacity - size) % rewind->capacity;
+    rewind->used -= size;
+    rewind->count -= 1;
+    memset(gb->tile_dirty, 1, sizeof(gb->tile_dirty));
+    gb->oam_dirty = true;
+    jit_drop_ram_blocks(gb);
+    load_machine(gb, &machine);
+    return(true);
+}
+
+uint32_t gb_rewind_count(gameboy_t *gb)
+{
+    return(gb->rewind.count);
+}
+
+// Banks count as saved as soon as their contents are taken for a save, so writes made while the
+// file is written flag them again. A failed save flags them all and retries later.
+struct save_writer_t
+{
+    thread_t thread;
+    char path[MAX_PATH_LENGTH];
+    uint8_t data[MAX_RAM_SIZE];
+    uint32_t size;
+    uint8_t banks;
+    bool running;
+    bool result;
+    volatile uint32_t done;
+};
+
+static bool save_due(gameboy_t *gb)
+{
+    bool result = (strlen(gb->rom_path) > 0 && !gb->no_save_file && gb->saved_banks != battery_banks(gb));
+    return(result);
+}
+
+static bool save_path(gameboy_t *gb, char *path)
+{
+    // gb_rom_load only accepts paths leaving room for the suffixes, so this never truncates.
+    int length = snprintf(path, MAX_PATH_LENGTH, "%s.sav", gb->rom_path);
+    bool result = (length > 0 && length < MAX_PATH_LENGTH);
+    return(result);
+}
+
+static bool write_save(const char *path, const uint8_t *data, uint32_t size)
+{
+    // The RAM goes to a temporary file that is on disk before it replaces the save, so neither a
+    // crash nor a power loss leaves a half written save behind.
+    char temp_path[MAX_PATH_LENGTH];
+    int length = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    bool result = (length > 0 && length < MAX_PATH_LENGTH &&
+        write_file(temp_path, data, size) && replace_file(temp_path, path));
+    return(result);
+}
+
+static void save_finished(gameboy_t *gb, bool result, uint8_t banks)
+{
+    if(!result)
+    {
+        gb->saved_banks &= (uint8_t)~banks;
+        gb->save_delay = SAVE_DELAY_FRAMES;
+        update_ram_pages(gb);
+    }
+}
+
+static THREAD_PROC(save_proc)
+{
+    save_writer_t *writer = data;
+    writer->result = write_save(writer->path, writer->data, writer->size);
+    atomic_store_u32(&writer->done, 1);
+    return(0);
+}
+
+static void finish_save(gameboy_t *gb, bool wait)
+{
+    save_writer_t *writer = gb->save_writer;
+    if(writer && writer->running && (wait || atomic_load_u32(&writer->done)))
+    {
+        thread_join(writer->thread);
+        writer->running = false;
+        save_finished(gb, writer->result, writer->banks);
+    }
+}
+
+void gb_reset(gameboy_t *gb)
+{
+    finish_save(gb, true);
+    memset(&gb->registers, 0, sizeof(registers_t));
+    gb->registers.af = 0x01B0,
+    gb->registers.bc = 0x0013,
+    gb->registers.de = 0x00D8,
+    gb->registers.hl = 0x014D,
+    gb->registers.sp = 0xFFFE,
+    gb->registers.pc = 0x0100,
+    gb->op_cycles = 0;
+
+    memset(&gb->state, 0, sizeof(state_t));
+    gb->state.ime = 1;
+
+
+    memset(gb->memory, 0, 0x10000);
+    gb->memory[0xFF00] = 0xCF;
+    gb->memory[0xFF02] = 0x7E;
+    gb->memory[0xFF04] = 0xAB;
+    gb->memory[0xFF07] = 0xF8;
+    gb->memory[0xFF0F] = 0xE1;
+    gb->memory[0xFF10] = 0x80;
+    gb->memory[0xFF11] = 0xBF;
+    gb->memory[0xFF12] = 0xF3;
+    gb->memory[0xFF13] = 0xFF;
+    gb->memory[0xFF14] = 0xBF;
+    gb->memory[0xFF16] = 0x3F;
+    gb->memory[0xFF19] = 0xBF;
+    gb->memory[0xFF1A] = 0x7F;
+    gb->memory[0xFF1B] = 0xFF;
+    gb->memory[0xFF1C] = 0x9F;
+    gb->memory[0xFF1D] = 0xFF;
+    gb->memory[0xFF1E] = 0xBF;
+    gb->memory[0xFF20] = 0xFF;
+    gb->memory[0xFF23] = 0xBF;
+    gb->memory[0xFF24] = 0x77;
+    gb->memory[0xFF25] = 0xF3;
+    gb->memory[0xFF26] = 0x80;
+    gb->memory[0xFF40] = 0x91;
+    gb->memory[0xFF41] = 0x80;
+    gb->memory[0xFF46] = 0xFF;
+    gb->memory[0xFF47] = 0xFC;
+    gb->memory[0xFF48] = 0xFF;
+    gb->memory[0xFF49] = 0xFF;
+    gb->memory[0xFF4D] = 0xFF;
+    gb->memory[0xFF4F] = 0xFF;
+    gb->memory[0xFF70] = 0xFF;
+
+    gb->rom_bank = 0;
+    gb->ram_bank = 0;
+    gb->rom_page = gb->rom_banks[1];
+    gb->ram_page = gb->ram_banks[0];
+    memset(gb->scanline_sprites, 0, sizeof(gb->scanline_sprites));
+    gb->num_scanline_sprites = 0;
+    gb->frames = 0;
+
+    memset(gb->ram, 0, MAX_RAM_SIZE);
+    memset(gb->dirty, 1, sizeof(gb->dirty));
+    gb->saved_banks = battery_banks(gb);
+    gb->save_delay = 0;
+    memset(gb->tile_dirty, 1, sizeof(gb->tile_dirty));
+    gb->oam_dirty = true;
+    jit_flush(gb);
+    update_pages(gb);
+
+    memset(&gb->cycles, 0, sizeof(cycles_t));
+    for(uint8_t i = 0; i < EVENT_COUNT; i++)
+        gb->cycles.events[i] = NEVER;
+    gb->cycles.div_base = (uint64_t)0 - 0xAB*256;
+    schedule(gb, EVENT_LCD, lcd_mode_cycles[gb->lcd->status.mode]);
+
+    // The boot ROM's sound has faded out by the time it hands over, channel 1 stays enabled.
+    memset(&gb->apu, 0, sizeof(apu_t));
+    gb->apu.channels[0].enabled = 1;
+    gb->apu.channels[0].next_step = channel_period(gb, 0);
+    reset_audio(&gb->audio);
+
+    clear_pixels(gb->framebuffer);
+
+    if(strlen(gb->rom_path) > 0)
+    {
+        char path[MAX_PATH_LENGTH];
+        if(!gb->no_save_file && save_path(gb, path))
+            load_ram(gb, path);
+        load_nintendo_logo(gb);
+    }
+}
+
+static rom_image_t *rom_image_alloc(uint32_t num_banks)
+{
+    rom_image_t *rom = calloc(1, sizeof(rom_image_t));
+    if(rom)
+    {
+        rom->data = calloc(num_banks, 0x4000);
+        rom->num_banks = num_banks;
+        rom->refs = 1;
+        if(!rom->data)
+        {
+            free(rom);
+            rom = NULL;
+        }
+    }
+    return(rom);
+}
+
+static void attach_rom(gameboy_t *gb, rom_image_t *rom)
+{
+    ATOMIC_INCREMENT(&rom->refs);
+    if(gb->rom_image)
+        gb_rom_release(gb->rom_image);
+    gb->rom_image = rom;
+    gb->rom = rom->data;
+    gb->cartridge_header = (cartridge_header_t *)(rom->data + 0x100);
+    for(uint32_t i = 0; i < MAX_ROM_SIZE/0x4000; i++)
+        gb->rom_banks[i] = rom->data + (i%rom->num_banks)*0x4000;
+}
+
+rom_image_t *gb_rom_load(const char *path)
+{
+    // ROMs made of whole banks are mapped, anything else is read into a padded copy. The path
+    // must leave room for the save file and its temporary copy next to it.
+    if(strlen(path) + sizeof(".sav.tmp") > MAX_PATH_LENGTH)
+        return(NULL);
+
+    rom_image_t *rom = NULL;
+    uint32_t size = 0;
+    uint8_t *data = map_file(path, &size);
+    if(data && size >= 0x8000 && size <= MAX_ROM_SIZE && (size % 0x4000) == 0)
+    {
+        rom = calloc(1, sizeof(rom_image_t));
+        if(rom)
+        {
+            *rom = (rom_image_t){ .data = data, .size = size, .num_banks = size/0x4000, .mapped = true, .refs = 1 };
+            data = NULL;
+        }
+    }
+    if(data)
+        unmap_file(data, size);
+
+    // Files larger than any cartridge are rejected.
+    FILE *file = (rom ? NULL : fopen(path, "rb"));
+    if(file)
+    {
+        size = file_size(file);
+        rom = ((size <= MAX_ROM_SIZE) ? rom_image_alloc(MAX((size + 0x3FFF)/0x4000, 2)) : NULL);
+        if(rom)
+            rom->size = (uint32_t)fread(rom->data, 1, size, file);
+        fclose(file);
+    }
+
+    if(rom)
+    {
+        snprintf(rom->path, sizeof(rom->path), "%s", path);
+        uint8_t checksum = 0;
+        for(uint16_t address = 0x0134; address <= 0x014C; address++)
+            checksum = checksum - rom->data[address] - 1;
+        if(checksum != rom->data[0x14D])
+        {
+            gb_rom_release(rom);
+            rom = NULL;
+        }
+    }
+    return(rom);
+}
+
+void gb_rom_release(rom_image_t *rom)
+{
+    if(ATOMIC_DECREMENT(&rom->refs) == 0)
+    {
+        if(rom->mapped)
+            unmap_file(rom->data, rom->size);
+        else
+            free(rom->data);
+        free(rom);
+    }
+}
+
+bool gb_load_rom(gameboy_t *gb, rom_image_t *rom)
+{
+    attach_rom(gb, rom);
+    snprintf(gb->rom_path, sizeof(gb->rom_path), "%s", rom->path);
+    gb_reset(gb);
+    rewind_clear(gb);
+    return(true);
+}
+
+bool gb_load(gameboy_t *gb, const char *path)
+{
+    bool result = false;
+    rom_image_t *rom = gb_rom_load(path);
+    if(rom)
+    {
+        result = gb_load_rom(gb, rom);
+        gb_rom_release(rom);
+    }
+    else
+    {
+        gb_reset(gb);
+        rewind_clear(gb);
+    }
+    return(result);
+}
+
+void gb_save(gameboy_t *gb)
+{
+    finish_save(gb, true);
+    gb->save_delay = 0;
+    char path[MAX_PATH_LENGTH];
+    if(save_due(gb) && save_path(gb, path))
+    {
+        uint8_t banks = battery_banks(gb);
+        gb->saved_banks = banks;
+        update_ram_pages(gb);
+        save_finished(gb, write_save(path, gb->ram, battery_size(gb)), banks);
+    }
+}
+
+void gb_autosave(gameboy_t *gb)
+{
+    finish_save(gb, false);
+    if(gb->save_delay > 0 && --gb->save_delay == 0)
+    {
+        if(!gb->save_writer)
+            gb->save_writer = calloc(1, sizeof(save_writer_t));
+
+        save_writer_t *writer = gb->save_writer;
+        if(!writer)
+        {
+            gb_save(gb);
+        }
+        else if(writer->running)
+        {
+            // The previous save is still being written, this one follows once it's done.
+            gb->save_delay = 1;
+        }
+        else if(save_due(gb) && save_path(gb, writer->path))
+        {
+            writer->size = battery_size(gb);
+            writer->banks = battery_banks(gb);
+            memcpy(writer->data, gb->ram, writer->size);
+            atomic_store_u32(&writer->done, 0);
+            gb->saved_banks = writer->banks;
+            update_ram_pages(gb);
+            writer->running = thread_create(&writer->thread, save_proc, writer);
+            if(!writer->running)
+                save_finished(gb, write_save(writer->path, writer->data, writer->size), writer->banks);
+        }
+    }
+}
+
+// Movie files start with a header identifying the format and ROM, followed by the run length
+// encoded button masks. Runs are split at 65535 frames.
+#define MOVIE_MAGIC 0x4D424754
+
+typedef struct movie_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frames;
+    uint32_t num_runs;
+    uint16_t global_checksum;
+    uint8_t checksum;
+    uint8_t reserved;
+} movie_header_t;
+
+bool gb_movie_record(movie_t *movie, uint8_t buttons)
+{
+    movie_run_t *last = (movie->num_runs ? &movie->runs[movie->num_runs - 1] : NULL);
+    if(last && last->buttons == buttons && last->frames < UINT16_MAX)
+    {
+        last->frames += 1;
+    }
+    else
+    {
+        if(movie->num_runs == movie->max_runs)
+        {
+            uint32_t max_runs = MAX(2*movie->max_runs, 256);
+            movie_run_t *runs = realloc(movie->runs, max_runs*sizeof(movie_run_t));
+            if(!runs)
+                return(false);
+            movie->runs = runs;
+            movie->max_runs = max_runs;
+        }
+        movie->runs[movie->num_runs++] = (movie_run_t){ .frames = 1, .buttons = buttons };
+    }
+    movie->frames += 1;
+    return(true);
+}
+
+bool gb_movie_play(movie_t *movie, uint8_t *buttons)
+{
+    if(movie->run >= movie->num_runs)
+        return(false);
+
+    movie_run_t *run = &movie->runs[movie->run];
+    *buttons = run->buttons;
+    if(++movie->run_frame == run->frames)
+    {
+        movie->run += 1;
+        movie->run_frame = 0;
+    }
+    return(true);
+}
+
+bool gb_movie_save(movie_t *movie, gameboy_t *gb, const char *path)
+{
+    bool result = false;
+    FILE *file = fopen(path, "wb");
+    if(file)
+    {
+        movie_header_t header =
+        {
+            .magic = MOVIE_MAGIC,
+            .version = MOVIE_VERSION,
+            .frames = movie->frames,
+            .num_runs = movie->num_runs,
+            .global_checksum = gb->cartridge_header->global_checksum,
+            .checksum = gb->cartridge_header->checksum,
+        };
+        result = (fwrite(&header, sizeof(movie_header_t), 1, file) == 1);
+        if(movie->num_runs > 0)
+            result = result && (fwrite(movie->runs, sizeof(movie_run_t), movie->num_runs, file) == movie->num_runs);
+        fclose(file);
+    }
+    return(result);
+}
+
+bool gb_movie_load(movie_t *movie, gameboy_t *gb, const char *path)
+{
+    bool result = false;
+    FILE *file = fopen(path, "rb");
+    if(file)
+    {
+        movie_header_t header;
+        if(fread(&header, sizeof(movie_header_t), 1, file) == 1 &&
+            header.magic == MOVIE_MAGIC && header.version == MOVIE_VERSION &&
+            header.global_checksum == gb->cartridge_header->global_checksum &&
+            header.checksum == gb->cartridge_header->checksum)
+        {
+            movie_run_t *runs = malloc(MAX(header.num_runs, 1)*sizeof(movie_run_t));
+            if(runs && fread(runs, sizeof(movie_run_t), header.num_runs, file) == header.num_runs)
+            {
+                gb_movie_free(movie);
+                *movie = (movie_t)
+                {
+                    .runs = runs,
+                    .num_runs = header.num_runs,
+                    .max_runs = MAX(header.num_runs, 1),
+                    .frames = header.frames,
+                };
+                result = true;
+            }
+            else
+            {
+                free(runs);
+            }
+        }
+        fclose(file);
+    }
+    return(result);
+}
+
+void gb_movie_free(movie_t *movie)
+{
+    free(movie->runs);
+    *movie = (movie_t){ 0 };
+}
+
+static uint8_t palette_color(palette_t palette, uint8_t idx)
+{
+    uint8_t color = ((palette.value >> (2*idx)) & 0x3);
+    return(color);
+}
+
+// The 384 tiles in VRAM are decoded into one color index per pixel, leftmost pixel first.
+// Decoding happens on first use after the tile was written.
+static const uint8_t *tile_row(gameboy_t *gb, uint16_t tile, uint8_t line)
+{
+    if(gb->tile_dirty[tile])
+    {
+        uint8_t *data = (gb->memory + 0x8000 + 16*tile);
+        for(uint8_t y = 0; y < 8; y++)
+        {
+            uint8_t low = data[2*y];
+            uint8_t high = data[2*y + 1];
+            for(uint8_t x = 0; x < 8; x++)
+                gb->tile_cache[tile][y][x] = (((low >> (7 - x)) & 0x01) | (((high >> (7 - x)) & 0x01) << 1));
+        }
+        gb->tile_dirty[tile] = 0;
+    }
+    return(gb->tile_cache[tile][line]);
+}
+
+// Scanlines are composited in framebuffer format (shade and BG opaque bit) in a line buffer
+// with LINE_PADDING pixels on both sides, so tiles never have to be clipped. Tile rows are
+// processed 8 pixels at a time in a uint64_t, one pixel per byte. Color indices and shades are 2
+// bits wide, which allows comparing and masking all 8 at once without carries between the bytes.
+#define LINE_PADDING 8
+#define BYTES(value) (0x0101010101010101ull*(value))
+
+static FORCE_INLINE uint64_t load_pixels(const uint8_t *pixels)
+{
+    uint64_t result;
+    memcpy(&result, pixels, sizeof(uint64_t));
+    return(result);
+}
+
+static FORCE_INLINE void store_pixels(uint8_t *pixels, uint64_t value)
+{
+    memcpy(pixels, &value, sizeof(uint64_t));
+}
+
+static FORCE_INLINE uint64_t nonzero_mask(uint64_t pixels)
+{
+    uint64_t bits = ((pixels | (pixels >> 1)) & BYTES(0x01));
+    return(bits*0xFF);
+}
+
+static FORCE_INLINE uint64_t apply_palette(uint64_t indices, palette_t palette)
+{
+    uint64_t shades = 0;
+    for(uint8_t i = 0; i < 4; i++)
+        shades |= (~nonzero_mask(indices ^ BYTES(i)) & BYTES(palette_color(palette, i)));
+    return(shades);
+}
+
+static FORCE_INLINE void draw_bg_row(uint8_t *line, int16_t x, const uint8_t *row, palette_t palette)
+{
+    uint64_t indices = load_pixels(row);
+    uint64_t opaque = (nonzero_mask(indices) & BYTES(PIXEL_BG_OPAQUE));
+    store_pixels(line + LINE_PADDING + x, (apply_palette(indices, palette) | opaque));
+}
+
+static FORCE_INLINE void draw_obj_row(uint8_t *line, int16_t x, const uint8_t *row, palette_t palette, bool flip, bool behind_bg)
+{
+    // Color index 0 is transparent, sprites behind the background only show where the
+    // background has color index 0. The opaque bit of the background is kept.
+    uint64_t indices = load_pixels(row);
+    if(flip)
+        indices = BSWAP64(indices);
+    uint64_t under = load_pixels(line + LINE_PADDING + x);
+    uint64_t mask = nonzero_mask(indices);
+    if(behind_bg)
+        mask &= ~((under >> 2) & BYTES(0x01))*0xFF;
+    uint64_t shades = apply_palette(indices, palette);
+    store_pixels(line + LINE_PADDING + x, ((under & ~mask) | ((shades | (under & BYTES(PIXEL_BG_OPAQUE))) & mask)));
+}
+
+static void convert_pixels(uint32_t *pixels, const uint8_t *shades, uint32_t count, const uint32_t *palette)
+{
+    uint32_t x = 0;
+#if HAS_SSE2
+    // Shades are widened to 32 bits and each of the four colors is selected with a compare mask.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i shade_mask = _mm_set1_epi8(PIXEL_SHADE);
+    __m128i colors[4];
+    __m128i values[4];
+    for(uint8_t i = 0; i < 4; i++)
+    {
+        colors[i] = _mm_set1_epi32((int32_t)palette[i]);
+        values[i] = _mm_set1_epi32(i);
+    }
+    for(; x + 16 <= count; x += 16)
+    {
+        __m128i bytes = _mm_and_si128(_mm_loadu_si128((const __m128i *)(shades + x)), shade_mask);
+        __m128i words[2] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+        for(uint8_t i = 0; i < 4; i++)
+        {
+            __m128i word = words[i/2];
+            __m128i dwords = ((i & 1) ? _mm_unpackhi_epi16(word, zero) : _mm_unpacklo_epi16(word, zero));
+            __m128i argb = zero;
+            for(uint8_t j = 0; j < 4; j++)
+                argb = _mm_or_si128(argb, _mm_and_si128(_mm_cmpeq_epi32(dwords, values[j]), colors[j]));
+            _mm_storeu_si128((__m128i *)(pixels + x + 4*i), argb);
+        }
+    }
+#endif
+    for(; x < count; x++)
+        pixels[x] = palette[shades[x] & PIXEL_SHADE];
+}
+
+void gb_present(gameboy_t *gb, uint32_t *pixels, const uint32_t *colors)
+{
+    convert_pixels(pixels, gb->framebuffer, SCREEN_W*SCREEN_H, (colors ? colors : gb_colors));
+}
+
+static void set_mode(gameboy_t *gb, lcd_mode_e mode)
+{
+    state_t locks = gb->state;
+    if(mode == LCD_MODE_HBLANK)
+    {
+        gb->state.no_oam_access = 0;
+        gb->state.no_vram_access = 0;
+        if(gb->lcd->status.hblank_interrupt)
+            gb->interrupt_f->stat = 1;
+    }
+    else if(mode == LCD_MODE_PIXEL_TRANSFER)
+    {
+        gb->state.no_oam_access = 1;
+        gb->state.no_vram_access = 1;
+    }
+    else if(mode == LCD_MODE_SCAN_OAM)
+    {
+        gb->state.no_oam_access = 1;
+        gb->state.no_vram_access = 0;
+        if(gb->lcd->status.oam_interrupt)
+            gb->interrupt_f->stat = 1;
+    }
+    else if(mode == LCD_MODE_VBLANK)
+    {
+        gb->state.no_oam_access = 0;
+        gb->state.no_vram_access = 0;
+        gb->interrupt_f->vblank = 1;
+    }
+    gb->lcd->status.mode = mode;
+
+    if(gb->state.no_vram_access != locks.no_vram_access)
+        update_vram_pages(gb);
+    if(gb->state.no_oam_access != locks.no_oam_access)
+        update_oam_pages(gb);
+}
+
+static void set_ly(gameboy_t *gb, uint8_t value)
+{
+    if(gb->lcd->ly != value)
+    {
+        gb->lcd->ly = value;
+        gb->lcd->status.lyc_equal_ly = (gb->lcd->ly == gb->lcd->lyc);
+        if(gb->lcd->status.lyc_equal_ly && gb->lcd->status.lyc_equal_ly_interrupt)
+            gb->interrupt_f->stat = 1;
+    }
+}
+
+static void set_rom_bank(gameboy_t *gb, uint8_t bank)
+{
+    if(bank != gb->rom_bank)
+    {
+        uint16_t size = rom_kib(gb);
+        uint8_t num = (uint8_t)(size/16);
+        gb->rom_bank = MIN(MAX(bank, 1), (num - 1));
+        gb->rom_page = gb->rom_banks[gb->rom_bank];
+        update_rom_pages(gb);
+        PERF_COUNT(gb->perf.rom_bank_switches);
+    }
+}
+
+static void set_ram_bank(gameboy_t *gb, uint8_t bank)
+{
+    if(bank != gb->ram_bank)
+    {
+        gb->ram_bank = bank;
+        gb->ram_page = gb->ram_banks[bank];
+        update_ram_pages(gb);
+        PERF_COUNT(gb->perf.ram_bank_switches);
+    }
+}
+
+// The switchable ROM and RAM banks are not copied into memory but accessed through
+// the current bank pointers, so a bank switch only has to update a pointer.
+static uint8_t *memory_ptr(gameboy_t *gb, uint16_t address)
+{
+    uint8_t *ptr = gb->memory + address;
+    if(address <= 0x3FFF)
+        ptr = gb->rom_banks[0] + address;
+    else if(address >= 0x4000 && address <= 0x7FFF)
+        ptr = gb->rom_page + (address - 0x4000);
+    else if(address >= 0xA000 && address <= 0xBFFF)
+        ptr = gb->ram_page + (address - 0xA000);
+    else if(address >= 0xE000 && address <= 0xFDFF)
+        ptr = gb->memory + (address - 0x2000);
+    return(ptr);
+}
+
+static void write_cartridge_ram(gameboy_t *gb, uint16_t address, uint8_t value)
+{
+    if(gb->state.ram)
+    {
+        gb->ram_page[address - 0xA000] = value;
+        if(gb->saved_banks & (1 << gb->ram_bank))
+        {
+            battery_changed(gb, gb->ram_bank);
+            update_ram_pages(gb);
+        }
+    }
+}
+
+static void mem_w_slow(gameboy_t *gb, uint16_t address, uint8_t value)
+{
+    if(address >= 0x8000)
+        gb->dirty[state_page(gb, memory_ptr(gb, address))] = 1;
+
+    // Bank switches, switching the LCD and DMA change how the following instructions run, so
+    // translated blocks end after them.
+    if(address < 0x8000 || address == 0xFF40 || address == 0xFF46)
+        gb->jit.exit = true;
+
+    if(!gb->state.dma_transfer || (address >= 0xFF80 && address <= 0xFFFE))
+    {
+        if(address >= 0x0000 && address <= 0x1FFF)
+        {
+            gb->state.ram = (value & 0x0F) == 0x0A;
+            update_ram_pages(gb);
+        }
+        else if(address >= 0x2000 && address <= 0x3FFF)
+        {
+            uint8_t bank = ((gb->rom_bank & 0xE0) | (value & 0x1F));
+            set_rom_bank(gb, bank);
+        }
+        else if(address >= 0x4000 && address <= 0x5FFF)
+        {
+            uint8_t bank = (value & 0x3);
+            if(gb->state.mbc1_mode)
+            {
+                set_ram_bank(gb, bank);
+            }
+            else
+            {
+                bank = ((gb->rom_bank & 0x1F) | (bank << 5));
+                set_rom_bank(gb, bank);
+            }
+        }
+        else if(address >= 0x6000 && address <= 0x7FFF)
+        {
+            gb->state.mbc1_mode = ((value & 0x1) != 0);
+        }
+        else if(address >= 0x8000 && address <= 0x9FFF)
+        {
+            if(!gb->state.no_vram_access)
+            {
+                gb->memory[address] = value;
+                if(address <= 0x97FF)
+                    gb->tile_dirty[(address - 0x8000)/16] = 1;
+            }
+        }
+        else if(address >= 0xA000 && address <= 0xBFFF)
+        {
+            write_cartridge_ram(gb, address, value);
+        }
+        else if(address >= 0xC000 && address <= 0xDFFF)
+        {
+            gb->memory[address] = value;
+            if(is_code_byte(gb, address))
+                jit_invalidate(gb, address);
+        }
+        else if(address >= 0xFE00 && address <= 0xFE9F)
+        {
+            if(!gb->state.no_oam_access)
+            {
+                gb->memory[address] = value;
+                gb->oam_dirty = true;
+            }
+        }
+        else if(address >= 0xFF10 && address <= 0xFF3F)
+        {
+            write_apu(gb, address, value);
+        }
+        else if(address >= 0xFF00 && address <= 0xFF7F)
+        {
+            uint8_t old_value = gb->memory[address];
+            gb->memory[address] = value;
+            switch(address)
+            {
+                case 0xFF00:
+                {
+                    gb->memory[address] = (0xC0 | (value & 0x30) | (old_value & 0x0F));
+                    uint8_t buttons = gb->buttons;
+                    if(gb->joypad->select_direction == 0)
+                    {
+                        gb->joypad->right_or_a = ((buttons & BUTTON_RIGHT) == 0);
+                        gb->joypad->left_or_b = ((buttons & BUTTON_LEFT) == 0);
+                        gb->joypad->up_or_select = ((buttons & BUTTON_UP) == 0);
+                        gb->joypad->down_or_start = ((buttons & BUTTON_DOWN) == 0);
+                    }
+                    else if(gb->joypad->select_action == 0)
+                    {
+                        gb->joypad->right_or_a = ((buttons & BUTTON_A) == 0);
+                        gb->joypad->left_or_b = ((buttons & BUTTON_B) == 0);
+                        gb->joypad->up_or_select = ((buttons & BUTTON_SELECT) == 0);
+                        gb->joypad->down_or_start = ((buttons & BUTTON_START) == 0);
+                    }
+                    for(uint8_t i = 0; i < 4; i++)
+                    {
+                        if(((old_value & (1 << i)) != 0) && ((gb->memory[address] & (1 << i)) == 0))
+                            gb->interrupt_f->joypad = 1;
+                    }
+                    break;
+                }
+                case 0xFF04:
+                {
+                    // Resetting DIV while bit 12 is set clocks the frame sequencer early.
+                    sync_apu(gb);
+                    if((gb->cycles.now - gb->cycles.div_base) & (FRAME_SEQUENCER_CYCLES/2))
+                        clock_frame_sequencer(gb);
+                    gb->memory[address] = 0;
+                    gb->cycles.div_base = gb->cycles.now;
+                    break;
+                }
+                case 0xFF05:
+                {
+                    if(gb->timer->control.enable)
+                    {
+                        uint16_t clock = timer_clocks[gb->timer->control.clock];
+                        gb->cycles.tac = (uint16_t)((gb->cycles.now - gb->cycles.timer_base) % clock);
+                        start_timer(gb);
+                    }
+                    break;
+                }
+                case 0xFF40:
+                {
+                    if(!((lcd_control_t *)&value)->enable && ((lcd_control_t *)&old_value)->enable)
+                    {
+                        clear_pixels(gb->framebuffer);
+                        set_mode(gb, LCD_MODE_HBLANK);
+                        set_ly(gb, 0);
+                        schedule(gb, EVENT_LCD, NEVER);
+                    }
+                    else if(((lcd_control_t *)&value)->enable && !((lcd_control_t *)&old_value)->enable)
+                    {
+                        schedule(gb, EVENT_LCD, gb->cycles.now + lcd_mode_cycles[gb->lcd->status.mode]);
+                    }
+                    break;
+                }
+                case 0xFF07:
+                {
+                    update_timer(gb, *(timer_control_t *)&old_value);
+                    break;
+                }
+                case 0xFF41:
+                {
+                    gb->memory[address] = (0x80 | (value & 0x78) | (old_value & 0x07));
+                    break;
+                }
+                case 0xFF46:
+                {
+                    gb->state.dma_transfer = 1;
+                    update_bus(gb);
+                    schedule(gb, EVENT_DMA, gb->cycles.now + 160);
+                    break;
+                }
+                case 0xFF0F:
+                {
+                    gb->memory[address] = (0xE0 | value);
+                    break;
+                }
+            }
+        }
+        else if(address >= 0xFF80 && address <= 0xFFFF)
+        {
+            gb->memory[address] = value;
+            if(is_code_byte(gb, address))
+                jit_invalidate(gb, address);
+        }
+    }
+}
+
+static uint8_t mem_r_slow(gameboy_t *gb, uint16_t address)
+{
+    if(address == 0xFF04 || address == 0xFF05)
+        sync_timer(gb);
+
+    uint8_t value = 0xFF;
+    if(!((gb->state.no_oam_access) && (address >= 0xFE00 && address <= 0xFE9F)) &&
+        !(gb->state.no_vram_access && (address >= 0x8000 && address <= 0x9FFF)) &&
+        !(gb->state.dma_transfer && (address < 0xFF80 || address > 0xFFFE)))
+    {
+        value = ((address >= 0xFF10 && address <= 0xFF3F) ? read_apu(gb, address) : *memory_ptr(gb, address));
+    }
+    return(value);
+}
+
+static FORCE_INLINE uint8_t memory_region(uint16_t address)
+{
+    static const uint8_t regions[16] =
+    {
+        REGION_ROM, REGION_ROM, REGION_ROM, REGION_ROM,
+        REGION_ROM_BANK, REGION_ROM_BANK, REGION_ROM_BANK, REGION_ROM_BANK,
+        REGION_VRAM, REGION_VRAM, REGION_CARTRIDGE_RAM, REGION_CARTRIDGE_RAM,
+        REGION_WORK_RAM, REGION_WORK_RAM, REGION_ECHO_RAM, REGION_ECHO_RAM,
+    };
+    uint8_t region = regions[address >> 12];
+    if(address >= 0xFE00)
+        region = ((address < 0xFF00) ? REGION_OAM : ((address >= 0xFF80 && address < 0xFFFF) ? REGION_HIGH_RAM : REGION_IO));
+    return(region);
+}
+
+// High RAM shares its page with the IO registers, so it isn't in the page tables. It's never
+// switched or locked, not even during OAM DMA, and takes its own short path for the stack and
+// LDH traffic. Only translated code in it needs a check on writes.
+static FORCE_INLINE bool is_high_ram(uint16_t address)
+{
+    bool result = (address >= 0xFF80 && address != 0xFFFF);
+    return(result);
+}
+
+static FORCE_INLINE void mem_w(gameboy_t *gb, uint16_t address, uint8_t value)
+{
+    PERF_COUNT(gb->perf.writes[memory_region(address)]);
+    uint8_t *page = gb->write_map[HIGH(address)];
+    if(is_high_ram(address))
+    {
+        gb->memory[address] = value;
+        gb->dirty[HIGH(address) - 0x80] = 1;
+        if(is_code_byte(gb, address))
+            jit_invalidate(gb, address);
+    }
+    else if(page)
+    {
+        page[LOW(address)] = value;
+        gb->dirty[gb->write_dirty[HIGH(address)]] = 1;
+    }
+    else
+        mem_w_slow(gb, address, value);
+}
+
+static FORCE_INLINE uint8_t mem_r(gameboy_t *gb, uint16_t address)
+{
+    PERF_COUNT(gb->perf.reads[memory_region(address)]);
+    uint8_t *page = gb->read_map[HIGH(address)];
+    uint8_t value = (is_high_ram(address) ? gb->memory[address] : (page ? page[LOW(address)] : mem_r_slow(gb, address)));
+    return(value);
+}
+
+static FORCE_INLINE uint8_t r8_low_r(gameboy_t *gb, uint8_t op)
+{
+    uint8_t r = 0xFF;
+    switch((op & 0x0F))
+    {
+        case 0x00: case 0x08: r = gb->registers.b; break;
+        case 0x01: case 0x09: r = gb->registers.c; break;
+        case 0x02: case 0x0A: r = gb->registers.d; break;
+        case 0x03: case 0x0B: r = gb->registers.e; break;
+        case 0x04: case 0x0C: r = gb->registers.h; break;
+        case 0x05: case 0x0D: r = gb->registers.l; break;
+        case 0x06: case 0x0E: r = mem_r(gb, gb->registers.hl); gb->op_cycles += 4; break;
+        case 0x07: case 0x0F: r = gb->registers.a; break;
+    }
+    return(r);
+}
+
+static FORCE_INLINE void r8_low_w(gameboy_t *gb, uint8_t op, uint8_t value)
+{
+    switch((op & 0x0F))
+    {
+        case 0x00: case 0x08: gb->registers.b = value; break;
+        case 0x01: case 0x09: gb->registers.c = value; break;
+        case 0x02: case 0x0A: gb->registers.d = value; break;
+        case 0x03: case 0x0B: gb->registers.e = value; break;
+        case 0x04: case 0x0C: gb->registers.h = value; break;
+        case 0x05: case 0x0D: gb->registers.l = value; break;
+        case 0x06: case 0x0E: mem_w(gb, gb->registers.hl, value); gb->op_cycles += 4; break;
+        case 0x07: case 0x0F: gb->registers.a = value; break;
+    }
+}
+
+static FORCE_INLINE uint8_t r8_high_r(gameboy_t *gb, uint8_t op)
+{
+    uint8_t r = 0xFF;
+    switch((op & 0xF0))
+    {
+        case 0x00: case 0x40: r = ((op & 0x0F) <= 0x07 ? gb->registers.b : gb->registers.c); break;
+        case 0x10: case 0x50: r = ((op & 0x0F) <= 0x07 ? gb->registers.d : gb->registers.e); break;
+        case 0x20: case 0x60: r = ((op & 0x0F) <= 0x07 ? gb->registers.h : gb->registers.l); break;
+        case 0x30: case 0x70:
+        {
+            if((op & 0x0F) <= 0x07)
+            {
+                r = mem_r(gb, gb->registers.hl);
+                gb->op_cycles += 4;
+            }
+            else
+            {
+                r = gb->registers.a;
+            }
+            break;
+        }
+    }
+    return(r);
+}
+
+static FORCE_INLINE void r8_high_w(gameboy_t *gb, uint8_t op, uint8_t value)
+{
+    switch((op & 0xF0))
+    {
+        case 0x00: case 0x40:
+        {
+            if((op & 0x0F) <= 0x07)
+                gb->registers.b = value;
+            else
+                gb->registers.c = value;
+             break;
+        }
+        case 0x10: case 0x50:
+        {
+            if((op & 0x0F) <= 0x07)
+                gb->registers.d = value;
+            else
+                gb->registers.e = value;
+             break;
+        }
+        case 0x20: case 0x60:
+        {
+            if((op & 0x0F) <= 0x07)
+                gb->registers.h = value;
+            else
+                gb->registers.l = value;
+             break;
+        }
+        case 0x30: case 0x70:
+        {
+            if((op & 0x0F) <= 0x07)
+            {
+                mem_w(gb, gb->registers.hl, value);
+                gb->op_cycles += 4;
+            }
+            else
+            {
+                gb->registers.a = value;
+            }
+            break;
+        }
+    }
+}
+
+static FORCE_INLINE uint16_t *r16_rw(gameboy_t *gb, uint8_t op)
+{
+    uint16_t *r = NULL;
+    switch((op & 0xF0))
+    {
+        case 0x00: case 0xC0: r = &gb->registers.bc; break;
+        case 0x10: case 0xD0: r = &gb->registers.de; break;
+        case 0x20: case 0xE0: r = &gb->registers.hl; break;
+        case 0x30: r = &gb->registers.sp; break;
+        case 0xF0: r = &gb->registers.af; break;
+    }
+    return(r);
+}
+
+static FORCE_INLINE bool condition(gameboy_t *gb, uint8_t op)
+{
+    bool result = false;
+    switch(op)
+    {
+        case 0x20: case 0xC0: case 0xC2: case 0xC4: result = (gb->registers.f.z == 0); break;
+        case 0x30: case 0xD0: case 0xD2: case 0xD4: result = (gb->registers.f.c == 0); break;
+        case 0x28: case 0xC8: case 0xCA: case 0xCC: result = (gb->registers.f.z == 1); break;
+        case 0x38: case 0xD8: case 0xDA: case 0xDC: result = (gb->registers.f.c == 1); break;
+    }
+    return(result);
+}
+
+static FORCE_INLINE void execute_cb_op(gameboy_t *gb, uint8_t op)
+{
+    switch((op & 0xF0))
+    {
+        // RLC/RRC
+        case 0x00:
+        {
+            if((op & 0x0F) <= 0x07)
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit7 = (old_value & 0x80) != 0;
+                uint8_t value = ((old_value << 1) | bit7);
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit7;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            else
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit0 = (old_value & 0x01) != 0;
+                uint8_t value = ((old_value >> 1) | (bit0 << 7));
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit0;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            break;
+        }
+        // RL/RR
+        case 0x10:
+        {
+            if((op & 0x0F) <= 0x07)
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit7 = (old_value & 0x80) != 0;
+                uint8_t value = ((old_value << 1) | gb->registers.f.c);
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit7;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            else
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit0 = (old_value & 0x01) != 0;
+                uint8_t value = ((old_value >> 1) | (gb->registers.f.c << 7));
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit0;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            break;
+        }
+        // SLA/SRA
+        case 0x20:
+        {
+            if((op & 0x0F) <= 0x07)
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit7 = (old_value & 0x80) != 0;
+                uint8_t value = (old_value << 1);
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit7;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            else
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit0 = (old_value & 0x01) != 0;
+                uint8_t bit7 = (old_value & 0x80) != 0;
+                uint8_t value = ((old_value >> 1) | (bit7 << 7));
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit0;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            break;
+        }
+        // SWAP/SRL
+        case 0x30:
+        {
+            if((op & 0x0F) <= 0x07)
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t low = (old_value & 0x0F);
+                uint8_t high = (old_value >> 4);
+                uint8_t value = (low << 4 | high);
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = 0;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            else
+            {
+                uint8_t old_value = r8_low_r(gb, op);
+                uint8_t bit0 = (old_value & 0x01) != 0;
+                uint8_t value = (old_value >> 1);
+                r8_low_w(gb, op, value);
+                gb->registers.f.c = bit0;
+                gb->registers.f.h = 0;
+                gb->registers.f.n = 0;
+                gb->registers.f.z = (value == 0);
+                gb->op_cycles += 4;
+            }
+            break;
+        }
+        // BIT
+        case 0x40: case 0x50: case 0x60: case 0x70:
+        {
+            uint8_t value = r8_low_r(gb, op);
+            uint8_t bit = (((op >> 3) & 0x7) | ((op & 0x8) >> 3));
+            gb->registers.f.h = 1;
+            gb->registers.f.n = 0;
+            gb->registers.f.z = ((value & (1 << bit)) == 0);
+            gb->op_cycles += 4;
+            break;
+        }
+        // RES
+        case 0x80: case 0x90: case 0xA0: case 0xB0:
+        {
+            uint8_t value = r8_low_r(gb, op);
+            uint8_t bit = (((op >> 3) & 0x7) | ((op & 0x8) >> 3));
+            value &= ~(1 << bit);
+            r8_low_w(gb, op, value);
+            gb->op_cycles += 4;
+            break;
+        }
+        // SET
+        case 0xC0: case 0xD0: case 0xE0: case 0xF0:
+        {
+            uint8_t value = r8_low_r(gb, op);
+            uint8_t bit = (((op >> 3) & 0x7) | ((op & 0x8) >> 3));
+            value |= (1 << bit);
+            r8_low_w(gb, op, value);
+            gb->op_cycles += 4;
+            break;
+        }
+        default:
+        {
+            assert(false);
+            break;
+        }
+    }
+}
+
+// Every opcode gets its own handler which calls the generic implementation with a constant
+// opcode. Once inlined, the compiler resolves the opcode switch as well as the register and
+// condition decoding at compile time, leaving a single indirect call per instruction.
+typedef void (*op_handler_t)(gameboy_t *gb);
+
+#define OP_ROW(entry, high) \
+    entry(high##0) entry(high##1) entry(high##2) entry(high##3) \
+    entry(high##4) entry(high##5) entry(high##6) entry(high##7) \
+    entry(high##8) entry(high##9) entry(high##A) entry(high##B) \
+    entry(high##C) entry(high##D) entry(high##E) entry(high##F)
+
+#define OP_TABLE(entry) \
+    OP_ROW(entry, 0) OP_ROW(entry, 1) OP_ROW(entry, 2) OP_ROW(entry, 3) \
+    OP_ROW(entry, 4) OP_ROW(entry, 5) OP_ROW(entry, 6) OP_ROW(entry, 7) \
+    OP_ROW(entry, 8) OP_ROW(entry, 9) OP_ROW(entry, A) OP_ROW(entry, B) \
+    OP_ROW(entry, C) OP_ROW(entry, D) OP_ROW(entry, E) OP_ROW(entry, F)
+
+#define CB_HANDLER(op) static void cb_##op(gameboy_t *gb) { execute_cb_op(gb, 0x##op); }
+#define CB_ENTRY(op) cb_##op,
+
+OP_TABLE(CB_HANDLER)
+
+static const op_handler_t cb_handlers[256] = { OP_TABLE(CB_ENTRY) };
+
+static FORCE_INLINE void execute_op(gameboy_t *gb, uint8_t op)
+{
+    switch(op)
+    {
+        // NOP
+        case 0x00:
+        {
+            gb->op_cycles += 4;
+            break;
+        }
+        // STOP
+        case 0x10:
+        {
+            gb->state.stop = 1;
+            mem_w(gb, 0xFF04, 0);
+            gb->op_cycles += 4;
+            break;
+        }
+        // HALT
+        case 0x76:
+        {
+            gb->state.halt = 1;
+            gb->op_cycles += 4;
+            break;
+        }
+        // RLCA, ELA, RRCA, RRA
+        case 0x07: case 0x17: case 0x0F: case 0x1F:
+        {
+            execute_cb_op(gb, op);
+            gb->registers.f.z = 0;
+            break;
+        }
+        // JR i8
+        case 0x18:
+        {
+            int8_t value = (int8_t)mem_r(gb, gb->registers.pc++);
+            gb->registers.pc += value;
+            gb->op_cycles += 12;
+            break;
+        }
+        // JR condition, i8
+        case 0x20: case 0x28: case 0x30: case 0x38:
+        {
+            int8_t value = (int8_t)mem_r(gb, gb->registers.pc++);
+            if(condition(gb, op))
+            {
+                gb->registers.pc += value;
+                gb->op_cycles += 4;
+            }
+            gb->op_cycles += 8;
+            break;
+        }
+        // DAA
+        case 0x27:
+        {
+            if(gb->registers.f.n)
+            {
+                if(gb->registers.f.c)
+                    gb->registers.a -= 0x60;
+                if(gb->registers.f.h)
+                    gb->registers.a -= 0x06;
+            }
+            else
+            {
+                if(gb->registers.f.c || (gb->registers.a > 0x99))
+                {
+                    gb->registers.a += 0x60;
+                    gb->registers.f.c = 1;
+                }
+                if(gb->registers.f.h || ((gb->registers.a & 0x0F) > 0x09))
+                {
+                    gb->registers.a += 0x06;
+                }
+            }
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->registers.f.h = 0;
+            gb->op_cycles += 4;
+            break;
+        }
+        // CPL
+        case 0x2F:
+        {
+            gb->registers.a = ~gb->registers.a;
+            gb->registers.f.h = 1;
+            gb->registers.f.n = 1;
+            gb->op_cycles += 4;
+            break;
+        }
+        // SCF
+        case 0x37:
+        {
+            gb->registers.f.c = 1;
+            gb->registers.f.h = 0;
+            gb->registers.f.n = 0;
+            gb->op_cycles += 4;
+            break;
+        }
+        // CCF
+        case 0x3F:
+        {
+            gb->registers.f.c = !gb->registers.f.c;
+            gb->registers.f.h = 0;
+            gb->registers.f.n = 0;
+            gb->op_cycles += 4;
+            break;
+        }
+        // INC r16
+        case 0x03: case 0x13: case 0x23: case 0x33:
+        {
+            *r16_rw(gb, op) += 1;
+            gb->op_cycles += 8;
+            break;
+        }
+        // INC r8
+        case 0x04: case 0x14: case 0x24: case 0x34: case 0x0C: case 0x1C: case 0x2C: case 0x3C:
+        {
+            uint8_t old_value  = r8_high_r(gb, op);
+            uint8_t value = old_value + 1;
+            r8_high_w(gb, op, value);
+            gb->registers.f.h = ((value & 0xF0) != (old_value & 0xF0));
+            gb->registers.f.n = 0;
+            gb->registers.f.z = (value == 0);
+            gb->op_cycles += 4;
+            break;
+        }
+        // DEC r16
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+        {
+            *r16_rw(gb, op) -= 1;
+            gb->op_cycles += 8;
+            break;
+        }
+        // DEC r8
+        case 0x05: case 0x15: case 0x25:  case 0x35: case 0x0D: case 0x1D: case 0x2D:  case 0x3D:
+        {
+            uint8_t value = r8_high_r(gb, op);
+            value -= 1;
+            r8_high_w(gb, op, value);
+            gb->registers.f.h = ((value & 0x0F) == 0x0F);
+            gb->registers.f.n = 1;
+            gb->registers.f.z = (value == 0);
+            gb->op_cycles += 4;
+            break;
+        }
+        // LD r8, u8
+        case 0x06: case 0x16: case 0x26: case 0x36: case 0x0E: case 0x1E: case 0x2E: case 0x3E:
+        {
+            uint8_t value = mem_r(gb, gb->registers.pc++);
+            r8_high_w(gb, op, value);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD (u16), SP
+        case 0x08:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            uint16_t address = COMBINE(high, low);
+            mem_w(gb, address, LOW(gb->registers.sp));
+            mem_w(gb, address + 1, HIGH(gb->registers.sp));
+            gb->op_cycles += 20;
+            break;
+        }
+        // LD A, (r16)
+        case 0x0A: case 0x1A:
+        {
+            uint16_t value = *r16_rw(gb, op);
+            gb->registers.a = mem_r(gb, value);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD A, (HL+)
+        case 0x2A:
+        {
+            gb->registers.a = mem_r(gb, gb->registers.hl++);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD A, (HL-)
+        case 0x3A:
+        {
+            gb->registers.a = mem_r(gb, gb->registers.hl--);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD r16, u16
+        case 0x01: case 0x11: case 0x21: case 0x31:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            *r16_rw(gb, op) = COMBINE(high, low);
+            gb->op_cycles += 12;
+            break;
+        }
+        // LD (r8), A
+        case 0x02: case 0x12:
+        {
+            uint16_t address = *r16_rw(gb, op);
+            mem_w(gb, address, gb->registers.a);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD (HL+), A
+        case 0x22:
+        {
+            mem_w(gb, gb->registers.hl++, gb->registers.a);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD (HL-), A
+        case 0x32:
+        {
+            mem_w(gb, gb->registers.hl--, gb->registers.a);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD r8, r8
+        case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:
+        case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+        case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57:
+        case 0x58: case 0x59: case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+        case 0x60: case 0x61: case 0x62: case 0x63: case 0x64: case 0x65: case 0x66: case 0x67:
+        case 0x68: case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E: case 0x6F:
+        case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77:
+        case 0x78: case 0x79: case 0x7A: case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F:
+        {
+            uint8_t value = r8_low_r(gb, op);
+            r8_high_w(gb, op, value);
+            gb->op_cycles += 4;
+            break;
+        }
+        // LD (FF00+u8), A
+        case 0xE0:
+        {
+            uint8_t value = mem_r(gb, gb->registers.pc++);
+            mem_w(gb, (0xFF00 + value), gb->registers.a);
+            gb->op_cycles += 12;
+            break;
+        }
+        // LD A, (FF00+u8)
+        case 0xF0:
+        {
+            uint8_t value = mem_r(gb, gb->registers.pc++);
+            gb->registers.a = mem_r(gb, (0xFF00 + value));
+            gb->op_cycles += 12;
+            break;
+        }
+        // LD (FF00+C), A
+        case 0xE2:
+        {
+            mem_w(gb, (0xFF00 + gb->registers.c), gb->registers.a);
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD A, (FF00+C)
+        case 0xF2:
+        {
+            gb->registers.a = mem_r(gb, (0xFF00 + gb->registers.c));
+            gb->op_cycles += 8;
+            break;
+        }
+        // LD (u16), A
+        case 0xEA:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            uint16_t address = COMBINE(high, low);
+            mem_w(gb, address, gb->registers.a);
+            gb->op_cycles += 16;
+            break;
+        }
+        // LD A, (u16)
+        case 0xFA:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            uint16_t address = COMBINE(high, low);
+            gb->registers.a = mem_r(gb, address);
+            gb->op_cycles += 16;
+            break;
+        }
+        // LD SP, HL
+        case 0xF9:
+        {
+            gb->registers.sp = gb->registers.hl;
+            gb->op_cycles += 8;
+            break;
+        }
+        // ADD SP, i8
+        case 0xE8:
+        {
+            uint16_t old_value = gb->registers.sp;
+            int8_t value = (int8_t)mem_r(gb, gb->registers.pc++);
+            gb->registers.sp += value;
+            gb->registers.f.c = (gb->registers.sp < old_value);
+            gb->registers.f.h = ((gb->registers.sp & 0x0F) < (old_value & 0x0F));
+            gb->registers.f.n = 0;
+            gb->registers.f.z = 0;
+            gb->op_cycles += 16;
+            break;
+        }
+        // LD HL, SP+i8
+        case 0xF8:
+        {
+            int8_t value = (int8_t)mem_r(gb, gb->registers.pc++);
+            gb->registers.hl = gb->registers.sp + value;
+            gb->registers.f.c = (gb->registers.hl < gb->registers.sp);
+            gb->registers.f.h = ((gb->registers.hl & 0x0F) < (gb->registers.sp & 0x0F));
+            gb->registers.f.n = 0;
+            gb->registers.f.z = 0;
+            gb->op_cycles += 12;
+            break;
+        }
+        // ADD HL, r16
+        case 0x09: case 0x19: case 0x29: case 0x39:
+        {
+            uint16_t old_value = gb->registers.hl;
+            gb->registers.hl += *r16_rw(gb, op);
+            gb->registers.f.c = (gb->registers.hl < old_value);
+            gb->registers.f.h = ((gb->registers.hl & 0x00FF) < (old_value & 0x00FF));
+            gb->registers.f.n = 0;
+            gb->op_cycles += 8;
+            break;
+        }
+        // ADD A, r8/u8
+        case 0x80: case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86: case 0x87: case 0xC6:
+        {
+            uint8_t old_value = gb->registers.a;
+            gb->registers.a += ((op == 0xC6) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            gb->registers.f.c = (gb->registers.a < old_value);
+            gb->registers.f.h = ((gb->registers.a & 0x0F) < (old_value & 0x0F));
+            gb->registers.f.n = 0;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xC6) ? 8 : 4);
+            break;
+        }
+        // ADC A, r8/u8
+        case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8C: case 0x8D: case 0x8E: case 0x8F: case 0xCE:
+        {
+            uint8_t value = ((op == 0xCE) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            uint16_t a = gb->registers.a + value + gb->registers.f.c;
+            uint16_t a_nibble = (gb->registers.a & 0x0F) + (value & 0x0F) + gb->registers.f.c;
+            gb->registers.a = (uint8_t)a;
+            gb->registers.f.c = a > 0xFF;
+            gb->registers.f.h = a_nibble > 0x0F;
+            gb->registers.f.n = 0;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xCE) ? 8 : 4);
+            break;
+        }
+        // SUB A, r8/u8
+        case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97: case 0xD6:
+        {
+            uint8_t old_value = gb->registers.a;
+            gb->registers.a -= ((op == 0xD6) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            gb->registers.f.c = (gb->registers.a > old_value);
+            gb->registers.f.h = ((gb->registers.a & 0x0F) > (old_value & 0x0F));
+            gb->registers.f.n = 1;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xD6) ? 8 : 4);
+            break;
+        }
+        // SBC A, r8/u8
+        case 0x98: case 0x99: case 0x9A: case 0x9B: case 0x9C: case 0x9D: case 0x9E: case 0x9F: case 0xDE:
+        {
+            uint8_t value = ((op == 0xDE) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            int16_t a = gb->registers.a - value - gb->registers.f.c;
+            int16_t a_nibble = (gb->registers.a & 0x0F) - (value & 0x0F) - gb->registers.f.c;
+            gb->registers.a = (uint8_t)a;
+            gb->registers.f.c = a < 0;
+            gb->registers.f.h = a_nibble < 0;
+            gb->registers.f.n = 1;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xDE) ? 8 : 4);
+            break;
+        }
+        // AND A, r8/u8
+        case 0xA0: case 0xA1: case 0xA2: case 0xA3: case 0xA4: case 0xA5: case 0xA6: case 0xA7: case 0xE6:
+        {
+            gb->registers.a &= ((op == 0xE6) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            gb->registers.f.c = 0;
+            gb->registers.f.h = 1;
+            gb->registers.f.n = 0;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xE6) ? 8 : 4);
+            break;
+        }
+        // XOR A, r8/u8
+        case 0xA8: case 0xA9: case 0xAA: case 0xAB: case 0xAC: case 0xAD: case 0xAE: case 0xAF: case 0xEE:
+        {
+            gb->registers.a ^= ((op == 0xEE) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            gb->registers.f.c = 0;
+            gb->registers.f.h = 0;
+            gb->registers.f.n = 0;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xEE) ? 8 : 4);
+            break;
+        }
+        // OR A, r8/u8
+        case 0xB0: case 0xB1: case 0xB2: case 0xB3: case 0xB4: case 0xB5: case 0xB6: case 0xB7: case 0xF6:
+        {
+            gb->registers.a |= ((op == 0xF6) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            gb->registers.f.c = 0;
+            gb->registers.f.h = 0;
+            gb->registers.f.n = 0;
+            gb->registers.f.z = (gb->registers.a == 0);
+            gb->op_cycles += ((op == 0xF6) ? 8 : 4);
+            break;
+        }
+        // CP A, r8/u8
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB: case 0xBC: case 0xBD: case 0xBE: case 0xBF: case 0xFE:
+        {
+            uint8_t value = ((op == 0xFE) ? mem_r(gb, gb->registers.pc++) : r8_low_r(gb, op));
+            gb->registers.f.c = (gb->registers.a < value);
+            gb->registers.f.h = ((gb->registers.a & 0x0F) < (value & 0x0F));
+            gb->registers.f.n = 1;
+            gb->registers.f.z = (gb->registers.a == value);
+            gb->op_cycles += ((op == 0xFE) ? 8 : 4);
+            break;
+        }
+        // POP
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1:
+        {
+            uint8_t low = mem_r(gb, gb->registers.sp++);
+            uint8_t high = mem_r(gb, gb->registers.sp++);
+            *r16_rw(gb, op) = COMBINE(high, low);
+            gb->op_cycles += 12;
+            break;
+        }
+        // PUSH
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+        {
+            uint16_t value = *r16_rw(gb, op);
+            mem_w(gb, --gb->registers.sp, HIGH(value));
+            mem_w(gb, --gb->registers.sp, LOW(value));
+            gb->op_cycles += 16;
+            break;
+        }
+        // JP u16
+        case 0xC3:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            gb->registers.pc = COMBINE(high, low);
+            gb->op_cycles += 16;
+            break;
+        }
+        // JP condition, u16
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            if(condition(gb, op))
+            {
+                gb->registers.pc = COMBINE(high, low);
+                gb->op_cycles += 4;
+            }
+            gb->op_cycles += 12;
+            break;
+        }
+        // JP HL
+        case 0xE9:
+        {
+            gb->registers.pc = gb->registers.hl;
+            gb->op_cycles += 4;
+            break;
+        }
+        // RET
+        case 0xC9:
+        {
+            uint8_t low = mem_r(gb, gb->registers.sp++);
+            uint8_t high = mem_r(gb, gb->registers.sp++);
+            gb->registers.pc = COMBINE(high, low);
+            gb->op_cycles += 16;
+            break;
+        }
+        // RET condition
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+        {
+            if(condition(gb, op))
+            {
+                uint8_t low = mem_r(gb, gb->registers.sp++);
+                uint8_t high = mem_r(gb, gb->registers.sp++);
+                gb->registers.pc = COMBINE(high, low);
+                gb->op_cycles += 12;
+            }
+            gb->op_cycles += 8;
+            break;
+        }
+        // RETI
+        case 0xD9:
+        {
+            gb->state.ime = 1;
+            uint8_t low = mem_r(gb, gb->registers.sp++);
+            uint8_t high = mem_r(gb, gb->registers.sp++);
+            gb->registers.pc = COMBINE(high, low);
+            gb->op_cycles += 16;
+            break;
+        }
+        // PREFIX CB
+        case 0xCB:
+        {
+            uint8_t cb_op = mem_r(gb, gb->registers.pc++);
+            PERF_COUNT(gb->perf.cb_ops[cb_op]);
+            cb_handlers[cb_op](gb);
+            gb->op_cycles += 4;
+            break;
+        }
+        // CALL u16
+        case 0xCD:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            mem_w(gb, --gb->registers.sp, HIGH(gb->registers.pc));
+            mem_w(gb, --gb->registers.sp, LOW(gb->registers.pc));
+            gb->registers.pc = COMBINE(high, low);
+            gb->op_cycles += 24;
+            break;
+        }
+        // CALL condition, u16
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+        {
+            uint8_t low = mem_r(gb, gb->registers.pc++);
+            uint8_t high = mem_r(gb, gb->registers.pc++);
+            if(condition(gb, op))
+            {
+                mem_w(gb, --gb->registers.sp, HIGH(gb->registers.pc));
+                mem_w(gb, --gb->registers.sp, LOW(gb->registers.pc));
+                gb->registers.pc = COMBINE(high, low);
+                gb->op_cycles += 12;
+            }
+            gb->op_cycles += 12;
+            break;
+        }
+        // RST 00h-38h
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+        {
+            mem_w(gb, --gb->registers.sp, HIGH(gb->registers.pc));
+            mem_w(gb, --gb->registers.sp, LOW(gb->registers.pc));
+            gb->registers.pc = (op & 0x38);
+            gb->op_cycles += 16;
+            break;
+        }
+        // DI
+        case 0xF3:
+        {
+            gb->state.ime = 0;
+            gb->op_cycles += 4;
+            break;
+        }
+        // EI
+        case 0xFB:
+        {
+            gb->state.pending_ime = 1;
+            gb->op_cycles += 4;
+            break;
+        }
+        // INVALID
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+        {
+            break;
+        }
+        default:
+        {
+            assert(false);
+            break;
+        }
+    }
+}
+
+#define OP_HANDLER(op) static void op_##op(gameboy_t *gb) { execute_op(gb, 0x##op); }
+#define OP_ENTRY(op) op_##op,
+
+OP_TABLE(OP_HANDLER)
+
+static const op_handler_t op_handlers[256] = { OP_TABLE(OP_ENTRY) };
+
+static bool interrupt_pending(gameboy_t *gb)
+{
+    bool result = ((gb->memory[0xFFFF] & gb->memory[0xFF0F] & 0x1F) != 0);
+    return(result);
+}
+
+static void push_interrupt(gameboy_t *gb, uint16_t address, uint8_t value)
+{
+    // The interrupt push bypasses the access locks but must never modify the ROM image. Cartridge
+    // RAM is written like by any other instruction, only when enabled and flagging battery banks.
+    if(address >= 0xA000 && address <= 0xBFFF)
+    {
+        gb->dirty[state_page(gb, memory_ptr(gb, address))] = 1;
+        PERF_COUNT(gb->perf.writes[memory_region(address)]);
+        write_cartridge_ram(gb, address, value);
+    }
+    else if(address >= 0x8000)
+    {
+        uint8_t *pointer = memory_ptr(gb, address);
+        uint16_t offset = (uint16_t)(pointer - gb->memory);
+        *pointer = value;
+        gb->dirty[state_page(gb, pointer)] = 1;
+        PERF_COUNT(gb->perf.writes[memory_region(address)]);
+        if(address <= 0x97FF)
+            gb->tile_dirty[(address - 0x8000)/16] = 1;
+        gb->oam_dirty |= (address >= 0xFE00 && address <= 0xFE9F);
+        if(is_code_byte(gb, offset))
+            jit_invalidate(gb, offset);
+    }
+}
+
+static void check_interrupt(gameboy_t *gb)
+{
+    if(gb->state.ime)
+    {
+        uint16_t interrupt = 0;
+        if(gb->interrupt_e->vblank && gb->interrupt_f->vblank)
+        {
+            interrupt = 0x40;
+            gb->interrupt_f->vblank = 0;
+        }
+        else if(gb->interrupt_e->stat && gb->interrupt_f->stat)
+        {
+            interrupt = 0x48;
+            gb->interrupt_f->stat = 0;
+        }
+        else if(gb->interrupt_e->timer && gb->interrupt_f->timer)
+        {
+            interrupt = 0x50;
+            gb->interrupt_f->timer = 0;
+        }
+        else if(gb->interrupt_e->joypad && gb->interrupt_f->joypad)
+        {
+            interrupt = 0x60;
+            gb->interrupt_f->joypad = 0;
+        }
+
+        if(interrupt)
+        {
+            PERF_COUNT(gb->perf.interrupts[(interrupt - 0x40)/8]);
+            push_interrupt(gb, --gb->registers.sp, HIGH(gb->registers.pc));
+            push_interrupt(gb, --gb->registers.sp, LOW(gb->registers.pc));
+            gb->registers.pc = interrupt;
+            gb->op_cycles += 20;
+            gb->state.ime = 0;
+        }
+    }
+
+    if(gb->state.pending_ime)
+    {
+        gb->state.ime = 1;
+        gb->state.pending_ime = 0;
+    }
+}
+
+static void bin_oam(gameboy_t *gb)
+{
+    // Sorts the sprites into per line lists, keeping the first 10 in OAM order for every line.
+    sprite_attribute_t *sprites = (sprite_attribute_t *)(gb->memory + 0xFE00);
+    uint8_t size = (gb->lcd->control.obj_size ? 16 : 8);
+    memset(gb->oam_bin_counts, 0, sizeof(gb->oam_bin_counts));
+    for(uint8_t i = 0; i < 40; i++)
+    {
+        uint8_t y = (sprites[i].py - 16);
+        for(uint16_t line = y; line < MIN(y + size, SCREEN_H); line++)
+        {
+            if(gb->oam_bin_counts[line] < MAX_SCANLINE_SPRITES)
+                gb->oam_bins[line][gb->oam_bin_counts[line]++] = i;
+        }
+    }
+    gb->oam_bin_size = size;
+    gb->oam_dirty = false;
+}
+
+static void scan_oam(gameboy_t *gb)
+{
+    if(gb->oam_dirty || gb->oam_bin_size != (gb->lcd->control.obj_size ? 16 : 8))
+        bin_oam(gb);
+
+    sprite_attribute_t *sprites = (sprite_attribute_t *)(gb->memory + 0xFE00);
+    uint8_t ly = gb->lcd->ly;
+    gb->num_scanline_sprites = 0;
+    if(ly < SCREEN_H)
+    {
+        for(uint8_t i = 0; i < gb->oam_bin_counts[ly]; i++)
+            gb->scanline_sprites[gb->num_scanline_sprites++] = sprites[gb->oam_bins[ly][i]];
+    }
+}
+
+static void pixel_transfer(gameboy_t *gb)
+{
+    PERF_COUNT(gb->perf.lines_rendered);
+    // With the background disabled the line stays blank (shade 0).
+    uint8_t line[LINE_PADDING + SCREEN_W + LINE_PADDING] = { 0 };
+    uint8_t ly = gb->lcd->ly;
+    if(gb->lcd->control.bg_and_window_enable)
+    {
+        // Tile ids address 0x8000-0x8FFF unsigned or 0x9000 +-128 tiles signed.
+        uint8_t tile_mode = gb->lcd->control.bg_and_window_tile_data_area;
+        uint8_t bg_tilemap_mode = gb->lcd->control.bg_tile_map_area;
+        uint8_t *bg_tilemap = (gb->memory + (bg_tilemap_mode ? 0x9C00 : 0x9800));
+        uint8_t start = (gb->lcd->scx/8)%32;
+        int16_t x = -(gb->lcd->scx%8);
+        int16_t y = (gb->lcd->scy + ly);
+        for(uint8_t i = 0; i < 21; i++)
+        {
+            uint8_t id = bg_tilemap[32*((y/8)%32) + ((start + i)%32)];
+            uint16_t tile = (tile_mode ? id : (256 + (int8_t)id));
+            draw_bg_row(line, x, tile_row(gb, tile, y%8), gb->lcd->bgp);
+            x += 8;
+        }
+        if(gb->lcd->control.window_enable && ly >= gb->lcd->wy)
+        {
+            uint8_t window_tilemap_mode = gb->lcd->control.window_tile_map_area;
+            uint8_t *window_tilemap = (gb->memory + (window_tilemap_mode ? 0x9C00 : 0x9800));
+            y = (ly - gb->lcd->wy);
+            for(x = 0; x < 21*8 && (gb->lcd->wx - 7) + x < SCREEN_W; x += 8)
+            {
+                uint8_t id = window_tilemap[32*(y/8) + (x/8)%32];
+                uint16_t tile = (tile_mode ? id : (256 + (int8_t)id));
+                draw_bg_row(line, ((gb->lcd->wx - 7) + x), tile_row(gb, tile, y%8), gb->lcd->bgp);
+            }
+        }
+    }
+    if(gb->lcd->control.obj_enable)
+    {
+        palette_t palettes[] = { gb->lcd->obp0, gb->lcd->obp1 };
+        for(uint8_t i = 0; i < gb->num_scanline_sprites; i++)
+        {
+            sprite_attribute_t *sprite = &gb->scanline_sprites[i];
+            int16_t x = (sprite->px - 8);
+            int16_t y = (sprite->py - 16);
+            if(x >= SCREEN_W)
+                continue;
+            uint8_t id = sprite->tile;
+            if(gb->lcd->control.obj_size)
+            {
+                if((ly - y) <= 7)
+                    id = (sprite->flags.flipy ? (sprite->tile + 1) : sprite->tile);
+                else
+                    id = (sprite->flags.flipy ? sprite->tile : (sprite->tile + 1));
+            }
+            uint8_t line_idx = (ly - y)%8;
+            if(sprite->flags.flipy)
+                line_idx = (7 - line_idx);
+            palette_t palette = palettes[sprite->flags.palette];
+            draw_obj_row(line, x, tile_row(gb, id, line_idx), palette, sprite->flags.flipx, sprite->flags.bg_and_window);
+        }
+    }
+    memcpy(gb->framebuffer + ly*SCREEN_W, line + LINE_PADDING, SCREEN_W);
+}
+
+bool gb_init(gameboy_t *gb)
+{
+    *gb = (gameboy_t)
+    {
+        .memory = calloc(1, 0x10000),
+        .framebuffer = calloc(1, SCREEN_W*SCREEN_H),
+        .ram = calloc(1, MAX_RAM_SIZE),
+        .render_interval = 1,
+    };
+
+    rom_image_t *rom = rom_image_alloc(2);
+    bool result = (gb->memory && gb->framebuffer && gb->ram && rom);
+    if(result)
+    {
+        attach_rom(gb, rom);
+        gb_rom_release(rom);
+        gb->joypad = (joypad_t *)(gb->memory + 0xFF00);
+        gb->timer = (timer_registers_t *)(gb->memory + 0xFF04);
+        gb->lcd = (lcd_t *)(gb->memory + 0xFF40);
+        gb->interrupt_e = (interrupt_t *)(gb->memory + 0xFFFF);
+        gb->interrupt_f = (interrupt_t *)(gb->memory + 0xFF0F);
+        init_audio_kernel(&gb->audio);
+
+        for(uint32_t i = 0; i < MAX_RAM_SIZE/0x2000; i++)
+            gb->ram_banks[i] = gb->ram + i*0x2000;
+
+        gb_reset(gb);
+    }
+    else
+    {
+        if(rom)
+            gb_rom_release(rom);
+        gb_free(gb);
+    }
+    return(result);
+}
+
+void gb_free(gameboy_t *gb)
+{
+    finish_save(gb, true);
+    free(gb->save_writer);
+    free(gb->memory);
+    free(gb->framebuffer);
+    if(gb->rom_image)
+        gb_rom_release(gb->rom_image);
+    free(gb->ram);
+    free(gb->rewind.buffer);
+    free(gb->rewind.shadow);
+    free(gb->run_ahead_state);
+    free(gb->jit.blocks);
+    free(gb->jit.code_bits);
+    if(gb->jit.code)
+        free_code(gb->jit.code, JIT_CODE_SIZE);
+    *gb = (gameboy_t){ 0 };
+}
+
+static void process_events(gameboy_t *gb)
+{
+    uint64_t now = gb->cycles.now;
+    uint64_t *events = gb->cycles.events;
+
+    if(events[EVENT_DMA] <= now)
+    {
+        uint16_t address = COMBINE(gb->memory[0xFF46], 00);
+        memcpy(gb->memory + 0xFE00, memory_ptr(gb, address), 0xA0);
+        gb->state.dma_transfer = 0;
+        gb->oam_dirty = true;
+        update_bus(gb);
+        events[EVENT_DMA] = NEVER;
+    }
+
+    // With TMA close to 0xFF the timer can overflow more than once per instruction.
+    while(events[EVENT_TIMER] <= now)
+    {
+        uint16_t clock = timer_clocks[gb->timer->control.clock];
+        gb->timer->counter = gb->timer->modulo;
+        gb->interrupt_f->timer = 1;
+        gb->cycles.timer_base = events[EVENT_TIMER] - (uint64_t)gb->timer->modulo*clock;
+        events[EVENT_TIMER] = gb->cycles.timer_base + 256*clock;
+    }
+
+    if(events[EVENT_LCD] <= now)
+    {
+        switch(gb->lcd->status.mode)
+        {
+            case LCD_MODE_SCAN_OAM:
+            {
+                scan_oam(gb);
+                set_mode(gb, LCD_MODE_PIXEL_TRANSFER);
+                break;
+            }
+            case LCD_MODE_PIXEL_TRANSFER:
+            {
+                // The frame being drawn becomes visible once frames is incremented at VBlank.
+                if(gb->render_interval && ((gb->frames + 1) % gb->render_interval) == 0)
+                    pixel_transfer(gb);
+                set_mode(gb, LCD_MODE_HBLANK);
+                break;
+            }
+            case LCD_MODE_HBLANK:
+            {
+                set_ly(gb, gb->lcd->ly + 1);
+                if(gb->lcd->ly == 144)
+                {
+                    gb->frames += 1;
+                    set_mode(gb, LCD_MODE_VBLANK);
+                }
+                else
+                {
+                    set_mode(gb, LCD_MODE_SCAN_OAM);
+                }
+                break;
+            }
+            case LCD_MODE_VBLANK:
+            {
+                set_ly(gb, gb->lcd->ly + 1);
+                if(gb->lcd->ly == 154)
+                {
+                    set_mode(gb, LCD_MODE_SCAN_OAM);
+                    set_ly(gb, 0);
+                }
+                break;
+            }
+        }
+        events[EVENT_LCD] += lcd_mode_cycles[gb->lcd->status.mode];
+    }
+
+    schedule(gb, EVENT_DMA, events[EVENT_DMA]);
+}
+
+uint32_t gb_step(gameboy_t *gb)
+{
+    uint32_t cycles = 0;
+
+    // HALT sleeps until an enabled interrupt is requested, STOP until a button is pressed.
+    if(gb->state.halt && interrupt_pending(gb))
+        gb->state.halt = 0;
+    if(gb->state.stop && gb->buttons)
+    {
+        sync_apu(gb);
+        gb->state.stop = 0;
+        gb->cycles.div_base = gb->cycles.now;
+    }
+
+    if(gb->state.halt || gb->state.stop)
+    {
+        // Only scheduled events can request an interrupt while the CPU sleeps, so time can
+        // jump straight to the next one instead of spinning through the idle instruction. With
+        // nothing scheduled at all the CPU still wakes once per frame to poll the buttons.
+        uint64_t wake = MIN(gb->cycles.next_event, gb->cycles.now + CYCLES_PER_FRAME);
+        cycles = (uint32_t)(wake - gb->cycles.now);
+        gb->cycles.now = wake;
+        PERF_ADD(gb->perf.halt_cycles, cycles);
+        if(gb->cycles.now >= gb->cycles.next_event)
+            process_events(gb);
+    }
+    else
+    {
+        gb->op_cycles = 0;
+
+        check_interrupt(gb);
+        uint8_t op = mem_r(gb, gb->registers.pc++);
+        PERF_COUNT(gb->perf.ops[op]);
+        op_handlers[op](gb);
+
+        cycles = gb->op_cycles;
+        gb->cycles.now += gb->op_cycles;
+        if(gb->cycles.now >= gb->cycles.next_event)
+            process_events(gb);
+    }
+
+    return(cycles);
+}
+
+#if defined(HAS_JIT)
+// Blocks are straight line code up to the first jump, call, return, HALT or STOP. Each
+// instruction becomes a call of its handler through a register holding the gameboy_t, and the
+// block returns early when a handler took an interrupt, ended the frame or flagged an exit.
+// The flags and registers stay in gameboy_t, so the handlers are shared with the interpreter
+// and every instruction still checks interrupts and events.
+#define JIT_MAX_OPS 32
+#define JIT_MAX_BLOCK_SIZE 1024
+
+typedef bool (*jit_handler_t)(gameboy_t *gb);
+typedef void (*jit_code_t)(gameboy_t *gb);
+
+// Instruction lengths, 0 for the opcodes that don't exist. STOP is run as a single byte.
+static const uint8_t op_lengths[256] =
+{
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+    1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    1, 1, 3, 0, 3, 1, 2, 1, 1, 1, 3, 0, 3, 0, 2, 1,
+    2, 1, 1, 0, 0, 1, 2, 1, 2, 1, 3, 0, 0, 0, 2, 1,
+    2, 1, 1, 1, 0, 1, 2, 1, 2, 1, 3, 1, 0, 0, 2, 1,
+};
+
+static bool ends_block(uint8_t op)
+{
+    bool result = false;
+    switch(op)
+    {
+        // STOP, HALT, JR, JP, CALL, RET, RETI, JP (HL) and RST
+        case 0x10: case 0x76:
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9:
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:
+        case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9:
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+        {
+            result = true;
+            break;
+        }
+    }
+    return(result);
+}
+
+static FORCE_INLINE bool run_op(gameboy_t *gb, uint8_t op, op_handler_t handler)
+{
+    // The instruction part of gb_step with the fetch done at translation time. When an interrupt
+    // is taken the instruction at its vector runs instead and the block ends. check_interrupt
+    // does nothing unless an enabled interrupt is requested or EI just ran.
+    gb->op_cycles = 0;
+    uint16_t pc = gb->registers.pc;
+    if((gb->state.ime && interrupt_pending(gb)) || gb->state.pending_ime)
+        check_interrupt(gb);
+    bool result = (gb->registers.pc == pc);
+    if(result)
+    {
+        PERF_COUNT(gb->perf.reads[memory_region(pc)]);
+        PERF_COUNT(gb->perf.ops[op]);
+        PERF_COUNT(gb->perf.jit_ops);
+        gb->registers.pc++;
+        handler(gb);
+    }
+    else
+    {
+        uint8_t vector_op = mem_r(gb, gb->registers.pc++);
+        PERF_COUNT(gb->perf.ops[vector_op]);
+        op_handlers[vector_op](gb);
+    }
+
+    // Only the last instruction of a block can jump or sleep, the others end it early when the
+    // frame is over or something flagged an exit.
+    gb->cycles.now += gb->op_cycles;
+    if(gb->cycles.now >= gb->cycles.next_event)
+    {
+        uint32_t frames = gb->frames;
+        process_events(gb);
+        result = (result && gb->frames == frames);
+    }
+    result = (result && !gb->jit.exit);
+    return(result);
+}
+
+#define JIT_HANDLER(op) static bool jit_##op(gameboy_t *gb) { return(run_op(gb, 0x##op, op_##op)); }
+#define JIT_ENTRY(op) jit_##op,
+
+OP_TABLE(JIT_HANDLER)
+
+static const jit_handler_t jit_handlers[256] = { OP_TABLE(JIT_ENTRY) };
+
+static uint16_t code_region_end(uint16_t address)
+{
+    // Only ROM, work RAM and high RAM are translated and no block crosses from one into another.
+    uint16_t result = 0;
+    if(address < 0x4000)
+        result = 0x3FFF;
+    else if(address < 0x8000)
+        result = 0x7FFF;
+    else if(address >= 0xC000 && address < 0xE000)
+        result = 0xDFFF;
+    else if(address >= 0xFF80 && address < 0xFFFF)
+        result = 0xFFFE;
+    return(result);
+}
+
+static uint8_t code_byte(gameboy_t *gb, uint16_t address)
+{
+    uint8_t value = ((address >= 0xFF80) ? gb->memory[address] : gb->read_pages[HIGH(address)][LOW(address)]);
+    return(value);
+}
+
+static uint8_t *emit(uint8_t *code, const uint8_t *bytes, uint32_t count)
+{
+    memcpy(code, bytes, count);
+    return(code + count);
+}
+
+static bool jit_compile(gameboy_t *gb, jit_block_t *block)
+{
+    // The gameboy_t lives in rbx for the whole block. On Windows the calls also need 32 bytes of
+    // shadow space, on both ABIs the pushed rbx keeps the stack aligned.
+#if defined(_WIN32)
+    // push rbx; sub rsp, 32; mov rbx, rcx
+    static const uint8_t prologue[] = { 0x53, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x89, 0xCB };
+    // mov rcx, rbx
+    static const uint8_t argument[] = { 0x48, 0x89, 0xD9 };
+    // add rsp, 32; pop rbx; ret
+    static const uint8_t epilogue[] = { 0x48, 0x83, 0xC4, 0x20, 0x5B, 0xC3 };
+#else
+    // push rbx; mov rbx, rdi
+    static const uint8_t prologue[] = { 0x53, 0x48, 0x89, 0xFB };
+    // mov rdi, rbx
+    static const uint8_t argument[] = { 0x48, 0x89, 0xDF };
+    // pop rbx; ret
+    static const uint8_t epilogue[] = { 0x5B, 0xC3 };
+#endif
+    // mov rax, imm64
+    static const uint8_t load_handler[] = { 0x48, 0xB8 };
+    // call rax
+    static const uint8_t call_handler[] = { 0xFF, 0xD0 };
+    // test al, al; jz rel32
+    static const uint8_t exit_if_false[] = { 0x84, 0xC0, 0x0F, 0x84 };
+
+    jit_t *jit = &gb->jit;
+    uint8_t *start = jit->code + jit->code_used;
+    uint8_t *code = emit(start, prologue, sizeof(prologue));
+    uint8_t *exits[JIT_MAX_OPS];
+    uint32_t num_ops = 0;
+    uint32_t address = block->start;
+    uint32_t end = code_region_end(block->start);
+    bool done = false;
+    while(!done && num_ops < JIT_MAX_OPS)
+    {
+        uint8_t op = code_byte(gb, (uint16_t)address);
+        uint8_t length = op_lengths[op];
+        if(length == 0 || address + length - 1 > end)
+            break;
+
+        if(num_ops > 0)
+        {
+            code = emit(code, exit_if_false, sizeof(exit_if_false));
+            exits[num_ops - 1] = code;
+            code += 4;
+        }
+        uint64_t handler = (uint64_t)(uintptr_t)jit_handlers[op];
+        code = emit(code, argument, sizeof(argument));
+        code = emit(code, load_handler, sizeof(load_handler));
+        code = emit(code, (uint8_t *)&handler, sizeof(handler));
+        code = emit(code, call_handler, sizeof(call_handler));
+        address += length;
+        num_ops += 1;
+        done = ends_block(op);
+    }
+    if(num_ops == 0)
+        return(false);
+
+    for(uint32_t i = 0; i + 1 < num_ops; i++)
+    {
+        int32_t offset = (int32_t)(code - (exits[i] + 4));
+        memcpy(exits[i], &offset, sizeof(offset));
+    }
+    code = emit(code, epilogue, sizeof(epilogue));
+
+    block->code = start;
+    block->end = (uint16_t)(address - 1);
+    jit->code_used = (uint32_t)((code - jit->code + 15) & ~15);
+    PERF_COUNT(gb->perf.jit_blocks);
+
+    if(block->start >= 0xC000)
+    {
+        block->next = jit->page_blocks[HIGH(block->start)];
+        jit->page_blocks[HIGH(block->start)] = (uint16_t)(block - jit->blocks);
+        mark_code_bytes(gb, block->start, block->end, true);
+        if(block->start < 0xE000)
+        {
+            for(uint32_t page = HIGH(block->start); page <= HIGH(block->end); page++)
+                jit->code_pages |= (1u << (page - 0xC0));
+            protect_code_pages(gb);
+        }
+    }
+    return(true);
+}
+
+static jit_block_t *jit_find(gameboy_t *gb, uint16_t pc)
+{
+    // Open addressing with a short probe sequence. An address finding neither its slot nor an
+    // empty one takes over the coldest slot that isn't translated, so addresses that ran a few
+    // times long ago can't keep a hot loop out of the table. It's only interpreted when every
+    // slot of the sequence is translated.
+    uint32_t key = pc;
+    if(pc >= 0x4000 && pc < 0x8000)
+        key |= (uint32_t)((gb->rom_page - gb->rom)/0x4000) << 16;
+    uint32_t index = (key*2654435761u) >> 19;
+    jit_block_t *result = NULL;
+    jit_block_t *coldest = NULL;
+    for(uint32_t i = 0; !result && i < 8; i++)
+    {
+        jit_block_t *block = &gb->jit.blocks[(index + i) & (JIT_BLOCKS - 1)];
+        if(block->key == JIT_EMPTY)
+            *block = (jit_block_t){ .key = key, .start = pc };
+        if(block->key == key)
+            result = block;
+        else if(!block->code && (!coldest || block->hits < coldest->hits))
+            coldest = block;
+    }
+    if(!result && coldest)
+    {
+        *coldest = (jit_block_t){ .key = key, .start = pc };
+        result = coldest;
+    }
+    return(result);
+}
+
+static uint32_t jit_step(gameboy_t *gb)
+{
+    // Runs the block starting at the current address, translating it once it's hot.
+    jit_t *jit = &gb->jit;
+    uint16_t pc = gb->registers.pc;
+    if(gb->state.halt || gb->state.stop || (gb->state.dma_transfer && pc < 0xFF80) || !code_region_end(pc))
+        return(gb_step(gb));
+
+    if(jit->code_used + JIT_MAX_BLOCK_SIZE > JIT_CODE_SIZE)
+    {
+        jit_flush(gb);
+        update_pages(gb);
+    }
+
+    jit_block_t *block = jit_find(gb, pc);
+    if(block && !block->code && block->hits != JIT_NEVER && ++block->hits >= JIT_HOT_COUNT)
+    {
+        if(!jit_compile(gb, block))
+            block->hits = JIT_NEVER;
+    }
+
+    uint64_t start = gb->cycles.now;
+    jit->exit = false;
+    if(block && block->code)
+    {
+        ((jit_code_t)block->code)(gb);
+    }
+    else
+    {
+        // Code that isn't translated is interpreted up to the end of its block the same way, so
+        // only addresses blocks start at are looked up and counted.
+        uint16_t end = code_region_end(pc);
+        uint32_t frames = gb->frames;
+        bool next = true;
+        while(next)
+        {
+            uint8_t op = code_byte(gb, pc);
+            gb_step(gb);
+            pc = (uint16_t)(pc + op_lengths[op]);
+            next = (op_lengths[op] && !ends_block(op) && gb->registers.pc == pc && pc <= end && gb->frames == frames && !jit->exit);
+        }
+    }
+    uint32_t cycles = (uint32_t)(gb->cycles.now - start);
+    return(cycles);
+}
+#else
+static uint32_t jit_step(gameboy_t *gb)
+{
+    return(gb_step(gb));
+}
+#endif
+
+bool gb_jit_init(gameboy_t *gb)
+{
+#if defined(HAS_JIT)
+    jit_t *jit = &gb->jit;
+    if(!jit->blocks)
+    {
+        jit->blocks = malloc(JIT_BLOCKS*sizeof(jit_block_t));
+        jit->code_bits = malloc(0x10000/8);
+        jit->code = alloc_code(JIT_CODE_SIZE);
+        if(!jit->blocks || !jit->code_bits || !jit->code)
+        {
+            free(jit->blocks);
+            free(jit->code_bits);
+            if(jit->code)
+                free_code(jit->code, JIT_CODE_SIZE);
+            *jit = (jit_t){ 0 };
+        }
+        jit_flush(gb);
+        update_pages(gb);
+    }
+    return(jit->blocks != NULL);
+#else
+    return(false);
+#endif
+}
+
+#if defined(GB_PERF_COUNTERS)
+static uint64_t perf_time(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    uint64_t result = (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+    return(result);
+}
+#endif
+
+uint64_t gb_run_frames(gameboy_t *gb, uint32_t count)
+{
+    uint64_t cycles = 0;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        // A frame ends when the PPU enters VBlank. With the LCD switched off no VBlank ever
+        // happens, so in that case a frame is simply CYCLES_PER_FRAME worth of emulation and
+        // runs in single steps to end at that exact cycle count.
+#if defined(GB_PERF_COUNTERS)
+        uint64_t start = perf_time();
+#endif
+        uint32_t frames = gb->frames;
+        uint32_t frame_cycles = 0;
+        bool jit = (gb->jit.blocks != NULL);
+        while(gb->frames == frames && (gb->lcd->control.enable || frame_cycles < CYCLES_PER_FRAME))
+            frame_cycles += ((jit && gb->lcd->control.enable) ? jit_step(gb) : gb_step(gb));
+        cycles += frame_cycles;
+        if(gb->audio_enabled)
+        {
+            sync_apu(gb);
+            flush_audio(gb);
+        }
+#if defined(GB_PERF_COUNTERS)
+        uint64_t frame_ns = perf_time() - start;
+        gb->perf.frames += 1;
+        gb->perf.frame_ns += frame_ns;
+        gb->perf.max_frame_ns = MAX(gb->perf.max_frame_ns, frame_ns);
+#endif
+    }
+    return(cycles);
+}
+
+uint64_t gb_run_ahead(gameboy_t *gb, uint32_t frames)
+{
+    size_t size = gb_state_size(gb);
+    if(frames > 0 && size > gb->run_ahead_size)
+    {
+        uint8_t *state = realloc(gb->run_ahead_state, size);
+        if(state)
+        {
+            gb->run_ahead_state = state;
+            gb->run_ahead_size = size;
+        }
+    }
+    if(frames == 0 || size > gb->run_ahead_size)
+        return(gb_run_frames(gb, 1));
+
+    // The real frame and all but the last speculative one are never seen, so only the last one
+    // is drawn, and only when render_interval would have drawn the real frame. Only the real
+    // frame is heard. Rolling back leaves the framebuffer alone and only invalidates the tiles,
+    // sprites and translated code the speculative frames changed.
+    uint32_t render_interval = gb->render_interval;
+    gb->render_interval = 0;
+    uint64_t cycles = gb_run_frames(gb, 1);
+    bool shown = (render_interval && (gb->frames % render_interval) == 0);
+
+    gb_save_state(gb, gb->run_ahead_state, size);
+    uint8_t saved_banks = gb->saved_banks;
+    uint32_t save_delay = gb->save_delay;
+    bool audio_enabled = gb->audio_enabled;
+    gb->audio_enabled = false;
+    gb_run_frames(gb, frames - 1);
+    gb->render_interval = (shown ? 1 : 0);
+    gb_run_frames(gb, 1);
+    gb->render_interval = render_interval;
+
+    // Pages written by the speculative frames are back to their state after the real one, so
+    // keeping them dirty is enough for rewind and there is no need to flag every page.
+    uint8_t dirty[STATE_PAGES];
+    memcpy(dirty, gb->dirty, sizeof(dirty));
+    gb_load_state(gb, gb->run_ahead_state, size);
+    memcpy(gb->dirty, dirty, sizeof(dirty));
+    gb->saved_banks = saved_banks;
+    gb->save_delay = save_delay;
+    gb->audio_enabled = audio_enabled;
+    update_ram_pages(gb);
+    return(cycles);
+}
+
+bool gb_perf_enabled(void)
+{
+#if defined(GB_PERF_COUNTERS)
+    return(true);
+#else
+    return(false);
+#endif
+}
+
+void gb_perf_reset(gameboy_t *gb)
+{
+    memset(&gb->perf, 0, sizeof(perf_counters_t));
+}
+
+static const char *region_names[REGION_COUNT] =
+{
+    "rom", "rom_bank", "vram", "cartridge_ram", "work_ram", "echo_ram", "oam", "io", "high_ram",
+};
+
+static const char *interrupt_names[5] = { "vblank", "stat", "timer", "serial", "joypad" };
+
+static void dump_counts(FILE *file, const uint64_t *counts, uint32_t count)
+{
+    fprintf(file, "[");
+    for(uint32_t i = 0; i < count; i++)
+        fprintf(file, "%s%llu", (i ? "," : ""), (unsigned long long)counts[i]);
+    fprintf(file, "]");
+}
+
+static void dump_top_ops(FILE *file, const char *name, const uint64_t *counts, uint64_t total)
+{
+    // Lists the 8 most executed opcodes, a simple selection is plenty for 256 entries.
+    bool listed[256] = { 0 };
+    fprintf(file, "%-13s", name);
+    for(uint32_t n = 0; n < 8; n++)
+    {
+        uint32_t top = 0;
+        for(uint32_t i = 1; i < 256; i++)
+        {
+            if(!listed[i] && (listed[top] || counts[i] > counts[top]))
+                top = i;
+        }
+        if(counts[top] == 0)
+            break;
+        listed[top] = true;
+        fprintf(file, " %02X:%.1f%%", top, 100.0*counts[top]/total);
+    }
+    fprintf(file, "\n");
+}
+
+void gb_perf_dump(gameboy_t *gb, FILE *file, bool json)
+{
+    perf_counters_t *perf = &gb->perf;
+    uint64_t ops = 0;
+    uint64_t cb_ops = 0;
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        ops += perf->ops[i];
+        cb_ops += perf->cb_ops[i];
+    }
+    uint64_t frame_ns = (perf->frames ? perf->frame_ns/perf->frames : 0);
+
+    if(json)
+    {
+        fprintf(file, "{\"frames\":%llu,\"frame_ns\":%llu,\"max_frame_ns\":%llu,\"instructions\":%llu,",
+            (unsigned long long)perf->frames, (unsigned long long)frame_ns, (unsigned long long)perf->max_frame_ns, (unsigned long long)ops);
+        fprintf(file, "\"halt_cycles\":%llu,\"lines_rendered\":%llu,\"rom_bank_switches\":%llu,\"ram_bank_switches\":%llu,",
+            (unsigned long long)perf->halt_cycles, (unsigned long long)perf->lines_rendered,
+            (unsigned long long)perf->rom_bank_switches, (unsigned long long)perf->ram_bank_switches);
+        fprintf(file, "\"apu_syncs\":%llu,\"audio_frames\":%llu,",
+            (unsigned long long)perf->apu_syncs, (unsigned long long)perf->audio_frames);
+        fprintf(file, "\"jit_blocks\":%llu,\"jit_ops\":%llu,",
+            (unsigned long long)perf->jit_blocks, (unsigned long long)perf->jit_ops);
+        fprintf(file, "\"interrupts\":{");
+        for(uint32_t i = 0; i < 5; i++)
+            fprintf(file, "%s\"%s\":%llu", (i ? "," : ""), interrupt_names[i], (unsigned long long)perf->interrupts[i]);
+        fprintf(file, "},\"reads\":{");
+        for(uint32_t i = 0; i < REGION_COUNT; i++)
+            fprintf(file, "%s\"%s\":%llu", (i ? "," : ""), region_names[i], (unsigned long long)perf->reads[i]);
+        fprintf(file, "},\"writes\":{");
+        for(uint32_t i = 0; i < REGION_COUNT; i++)
+            fprintf(file, "%s\"%s\":%llu", (i ? "," : ""), region_names[i], (unsigned long long)perf->writes[i]);
+        fprintf(file, "},\"ops\":");
+        dump_counts(file, perf->ops, 256);
+        fprintf(file, ",\"cb_ops\":");
+        dump_counts(file, perf->cb_ops, 256);
+        fprintf(file, "}\n");
+    }
+    else
+    {
+        fprintf(file, "frames:       %llu, %.3f ms avg, %.3f ms max\n", (unsigned long long)perf->frames, frame_ns/1e6, perf->max_frame_ns/1e6);
+        fprintf(file, "ops:          %llu (%llu cb), %llu halt cycles\n", (unsigned long long)ops, (unsigned long long)cb_ops, (unsigned long long)perf->halt_cycles);
+        if(ops)
+            dump_top_ops(file, "top ops:", perf->ops, ops);
+        if(cb_ops)
+            dump_top_ops(file, "top cb ops:", perf->cb_ops, cb_ops);
+        fprintf(file, "lines:        %llu rendered\n", (unsigned long long)perf->lines_rendered);
+        fprintf(file, "banks:        %llu rom, %llu ram switches\n", (unsigned long long)perf->rom_bank_switches, (unsigned long long)perf->ram_bank_switches);
+        fprintf(file, "audio:        %llu apu syncs, %llu frames\n", (unsigned long long)perf->apu_syncs, (unsigned long long)perf->audio_frames);
+        fprintf(file, "jit:          %llu blocks translated, %llu ops run translated\n", (unsigned long long)perf->jit_blocks, (unsigned long long)perf->jit_ops);
+        fprintf(file, "interrupts:  ");
+        for(uint32_t i = 0; i < 5; i++)
+            fprintf(file, " %s %llu", interrupt_names[i], (unsigned long long)perf->interrupts[i]);
+        fprintf(file, "\n");
+        for(uint32_t i = 0; i < REGION_COUNT; i++)
+        {
+            fprintf(file, "%-14s%llu reads, %llu writes\n", region_names[i],
+                (unsigned long long)perf->reads[i], (unsigned long long)perf->writes[i]);
+        }
+    }
+}
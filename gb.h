@@ -0,0 +1,594 @@
+#ifndef GB_H
+#define GB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define SCREEN_W 160
+#define SCREEN_H 144
+
+#define CLOCK_FREQUENCY 4194304
+#define CYCLES_PER_FRAME 70224
+
+#define MAX_ROM_SIZE (4*1024*1024)
+#define MAX_RAM_SIZE (64*1024)
+#define MAX_SCANLINE_SPRITES 10
+#define NUM_TILES 384
+#define MAX_PATH_LENGTH 260
+#define STATE_VERSION 2
+#define MOVIE_VERSION 1
+#define STATE_PAGES (0x80 + MAX_RAM_SIZE/0x100)
+
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_RING_FRAMES 8192
+#define AUDIO_BUFFER_SAMPLES 1024
+#define AUDIO_BLIP_PHASES 32
+#define AUDIO_BLIP_WIDTH 16
+
+typedef enum lcd_mode_e
+{
+    LCD_MODE_HBLANK = 0x00,
+    LCD_MODE_VBLANK = 0x01,
+    LCD_MODE_SCAN_OAM = 0x02,
+    LCD_MODE_PIXEL_TRANSFER = 0x03,
+} lcd_mode_e;
+
+typedef struct lcd_control_t
+{
+    uint8_t bg_and_window_enable : 1;
+    uint8_t obj_enable : 1;
+    uint8_t obj_size : 1;
+    uint8_t bg_tile_map_area : 1;
+    uint8_t bg_and_window_tile_data_area : 1;
+    uint8_t window_enable : 1;
+    uint8_t window_tile_map_area : 1;
+    uint8_t enable : 1;
+} lcd_control_t;
+
+typedef struct lcd_status_t
+{
+    uint8_t mode : 2;
+    uint8_t lyc_equal_ly : 1;
+    uint8_t hblank_interrupt : 1;
+    uint8_t vblank_interrupt : 1;
+    uint8_t oam_interrupt : 1;
+    uint8_t lyc_equal_ly_interrupt : 1;
+    uint8_t invalid : 1;
+} lcd_status_t;
+
+typedef union palette_t
+{
+    struct
+    {
+        uint8_t color0 : 2;
+        uint8_t color1 : 2;
+        uint8_t color2 : 2;
+        uint8_t color3 : 2;
+    };
+    uint8_t value;
+} palette_t;
+
+typedef struct lcd_t
+{
+    lcd_control_t control;
+    lcd_status_t status;
+    uint8_t scy;
+    uint8_t scx;
+    uint8_t ly;
+    uint8_t lyc;
+    uint8_t dma;
+    palette_t bgp;
+    palette_t obp0;
+    palette_t obp1;
+    uint8_t wy;
+    uint8_t wx;
+} lcd_t;
+
+typedef struct interrupt_t
+{
+    uint8_t vblank : 1;
+    uint8_t stat : 1;
+    uint8_t timer : 1;
+    uint8_t serial : 1;
+    uint8_t joypad : 1;
+    uint8_t invalid : 3;
+} interrupt_t;
+
+typedef struct timer_control_t
+{
+    uint8_t clock : 2;
+    uint8_t enable : 1;
+    uint8_t invalid : 5;
+} timer_control_t;
+
+typedef struct timer_registers_t
+{
+    uint8_t div;
+    uint8_t counter;
+    uint8_t modulo;
+    timer_control_t control;
+} timer_registers_t;
+
+typedef struct joypad_t
+{
+    uint8_t right_or_a : 1;
+    uint8_t left_or_b : 1;
+    uint8_t up_or_select : 1;
+    uint8_t down_or_start : 1;
+    uint8_t select_direction : 1;
+    uint8_t select_action : 1;
+    uint8_t invalid : 2;
+} joypad_t;
+
+typedef struct register_flags_t
+{
+    uint8_t invalid : 4;
+    uint8_t c : 1;
+    uint8_t h : 1;
+    uint8_t n : 1;
+    uint8_t z : 1;
+} register_flags_t;
+
+typedef struct registers_t
+{
+    union
+    {
+        struct
+        {
+            register_flags_t f;
+            uint8_t a;
+        };
+        uint16_t af;
+    };
+    union
+    {
+        struct
+        {
+            uint8_t c;
+            uint8_t b;
+        };
+        uint16_t bc;
+    };
+    union
+    {
+        struct
+        {
+            uint8_t e;
+            uint8_t d;
+        };
+        uint16_t de;
+    };
+    union
+    {
+        struct
+        {
+            uint8_t l;
+            uint8_t h;
+        };
+        uint16_t hl;
+    };
+    uint16_t sp;
+    uint16_t pc;
+} registers_t;
+
+typedef struct state_t
+{
+    uint8_t halt : 1;
+    uint8_t stop : 1;
+    uint8_t pending_ime : 1;
+    uint8_t ime : 1;
+    uint8_t ram : 1;
+    uint8_t mbc1_mode : 1;
+    uint8_t dma_transfer : 1;
+    uint8_t no_vram_access : 1;
+    uint8_t no_oam_access : 1;
+} state_t;
+
+typedef struct sprite_flags_t
+{
+    uint8_t palette_cgb : 3;
+    uint8_t vram_bank_cgb : 1;
+    uint8_t palette : 1;
+    uint8_t flipx : 1;
+    uint8_t flipy : 1;
+    uint8_t bg_and_window : 1;
+} sprite_flags_t;
+
+typedef struct sprite_attribute_t
+{
+    uint8_t py;
+    uint8_t px;
+    uint8_t tile;
+    sprite_flags_t flags;
+} sprite_attribute_t;
+
+typedef enum cartridge_type_e
+{
+    CARTRIDGE_TYPE_ROM = 0x00,
+    CARTRIDGE_TYPE_MBC1 = 0x01,
+    CARTRIDGE_TYPE_MBC1_RAM = 0x02,
+    CARTRIDGE_TYPE_MBC1_RAM_BATTERY = 0x03,
+    CARTRIDGE_TYPE_MBC2 = 0x05,
+    CARTRIDGE_TYPE_MBC2_BATTERY = 0x06,
+    CARTRIDGE_TYPE_ROM_RAM = 0x08,
+    CARTRIDGE_TYPE_ROM_RAM_BATTERY = 0x09,
+    CARTRIDGE_TYPE_MMM01 = 0x0B,
+    CARTRIDGE_TYPE_MMM01_RAM = 0x0C,
+    CARTRIDGE_TYPE_MMM01_RAM_BATTERY = 0x0D,
+    CARTRIDGE_TYPE_MBC3_TIMER_BATTERY = 0x0F,
+    CARTRIDGE_TYPE_MBC3_TIMER_RAM_BATTERY = 0x10,
+    CARTRIDGE_TYPE_MBC3 = 0x11,
+    CARTRIDGE_TYPE_MBC3_RAM = 0x12,
+    CARTRIDGE_TYPE_MBC3_RAM_BATTERY = 0x13,
+    CARTRIDGE_TYPE_MBC5 = 0x19,
+    CARTRIDGE_TYPE_MBC5_RAM = 0x1A,
+    CARTRIDGE_TYPE_MBC5_RAM_BATTERY = 0x1B,
+    CARTRIDGE_TYPE_MBC5_RUMBLE = 0x1C,
+    CARTRIDGE_TYPE_MBC5_RUMBLE_RAM = 0x1D,
+    CARTRIDGE_TYPE_MBC5_RUMBLE_RAM_BATTERY = 0x1E,
+    CARTRIDGE_TYPE_MBC6 = 0x20,
+    CARTRIDGE_TYPE_MBC7_SENSOR_RUMBLE_RAM_BATTERY = 0x22,
+    CARTRIDGE_TYPE_POCKET_CAMERA = 0xFC,
+    CARTRIDGE_TYPE_BANDAI_TAMA5 = 0xFD,
+    CARTRIDGE_TYPE_HUC3 = 0xFE,
+    CARTRIDGE_TYPE_HUC1_RAM_BATTERY = 0xFF,
+} cartridge_type_e;
+
+typedef struct cartridge_header_t
+{
+    uint8_t entry[4];
+    uint16_t logo[24];
+    union
+    {
+        char old_title[16];
+        struct
+        {
+            char title[15];
+            uint8_t cgb_mode;
+        };
+    };
+    char licensee[2];
+    uint8_t sgb_mode;
+    uint8_t type;
+    uint8_t rom_size;
+    uint8_t ram_size;
+    uint8_t destination;
+    uint8_t old_licensee;
+    uint8_t version;
+    uint8_t checksum;
+    uint16_t global_checksum;
+} cartridge_header_t;
+
+typedef enum event_e
+{
+    EVENT_DMA,
+    EVENT_TIMER,
+    EVENT_LCD,
+    EVENT_COUNT,
+} event_e;
+
+typedef struct cycles_t
+{
+    uint64_t now;
+    uint64_t next_event;
+    uint64_t events[EVENT_COUNT];
+    uint64_t div_base;
+    uint64_t timer_base;
+    uint16_t tac;
+} cycles_t;
+
+// Channel state that isn't visible in the sound registers. Channels only advance while enabled,
+// next_step is the cycle at which the duty, wave or noise position moves on.
+typedef struct apu_channel_t
+{
+    uint64_t next_step;
+    uint16_t length;
+    uint16_t lfsr;
+    uint16_t shadow_frequency;
+    uint8_t enabled;
+    uint8_t volume;
+    uint8_t envelope_timer;
+    uint8_t sweep_timer;
+    uint8_t sweep_enabled;
+    uint8_t position;
+    uint8_t reserved[4];
+} apu_channel_t;
+
+typedef struct apu_t
+{
+    apu_channel_t channels[4];
+    uint64_t time;
+    uint8_t frame_sequencer;
+    uint8_t reserved[7];
+} apu_t;
+
+// The output side of the APU: every change of a channel's level is added to deltas as a band
+// limited step, integrating them gives the samples. levels holds what each channel currently
+// contributes to the left and right output. The ring is written by the emulation and read by
+// the host, each side only ever advancing its own index.
+typedef struct audio_t
+{
+    float deltas[2][AUDIO_BUFFER_SAMPLES + AUDIO_BLIP_WIDTH];
+    float kernel[AUDIO_BLIP_PHASES][AUDIO_BLIP_WIDTH];
+    int32_t levels[4][2];
+    uint64_t position;
+    float sum[2];
+    float capacitor[2];
+    int16_t ring[AUDIO_RING_FRAMES][2];
+    volatile uint32_t read;
+    volatile uint32_t write;
+} audio_t;
+
+// The framebuffer holds one byte per pixel: the shade (0-3) in the low two bits and
+// PIXEL_BG_OPAQUE where the background/window color index is not 0.
+#define PIXEL_SHADE 0x03
+#define PIXEL_BG_OPAQUE 0x04
+
+// ROM images are read only and reference counted, so any number of instances running the same
+// game can share a single copy. Whenever possible the file is mapped instead of read, which also
+// shares it with other processes through the page cache.
+typedef struct rom_image_t
+{
+    uint8_t *data;
+    uint32_t size;
+    uint32_t num_banks;
+    bool mapped;
+    volatile long refs;
+    char path[MAX_PATH_LENGTH];
+} rom_image_t;
+
+typedef struct rewind_t
+{
+    uint8_t *buffer;
+    uint8_t *shadow;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t used;
+    uint32_t count;
+} rewind_t;
+
+// Translated blocks are found by address, blocks in the switchable ROM bank also by bank. The
+// code of all blocks is appended to one buffer, which starts over once it's full. Translated
+// RAM blocks are also linked into a list for the page they start on, so a write to code only
+// has to look at the blocks near it.
+#define JIT_BLOCKS 8192
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_NO_BLOCK UINT16_MAX
+
+typedef struct jit_block_t
+{
+    uint8_t *code;
+    uint32_t key;
+    uint16_t start;
+    uint16_t end;
+    uint16_t hits;
+    uint16_t invalidations;
+    uint16_t next;
+} jit_block_t;
+
+typedef struct jit_t
+{
+    jit_block_t *blocks;
+    uint16_t page_blocks[0x100];
+    uint8_t *code;
+    uint32_t code_used;
+    uint32_t code_pages;
+    uint8_t *code_bits;
+    bool exit;
+} jit_t;
+
+typedef enum memory_region_e
+{
+    REGION_ROM,
+    REGION_ROM_BANK,
+    REGION_VRAM,
+    REGION_CARTRIDGE_RAM,
+    REGION_WORK_RAM,
+    REGION_ECHO_RAM,
+    REGION_OAM,
+    REGION_IO,
+    REGION_HIGH_RAM,
+    REGION_COUNT,
+} memory_region_e;
+
+// Only collected when the core is built with GB_PERF_COUNTERS, otherwise everything stays 0.
+typedef struct perf_counters_t
+{
+    uint64_t ops[256];
+    uint64_t cb_ops[256];
+    uint64_t reads[REGION_COUNT];
+    uint64_t writes[REGION_COUNT];
+    uint64_t rom_bank_switches;
+    uint64_t ram_bank_switches;
+    uint64_t lines_rendered;
+    uint64_t halt_cycles;
+    uint64_t interrupts[5];
+    uint64_t frames;
+    uint64_t frame_ns;
+    uint64_t max_frame_ns;
+    uint64_t apu_syncs;
+    uint64_t audio_frames;
+    uint64_t jit_blocks;
+    uint64_t jit_ops;
+} perf_counters_t;
+
+typedef enum button_e
+{
+    BUTTON_RIGHT = 0x01,
+    BUTTON_LEFT = 0x02,
+    BUTTON_UP = 0x04,
+    BUTTON_DOWN = 0x08,
+    BUTTON_A = 0x10,
+    BUTTON_B = 0x20,
+    BUTTON_SELECT = 0x40,
+    BUTTON_START = 0x80,
+} button_e;
+
+typedef struct movie_run_t
+{
+    uint16_t frames;
+    uint8_t buttons;
+    uint8_t reserved;
+} movie_run_t;
+
+typedef struct movie_t
+{
+    movie_run_t *runs;
+    uint32_t num_runs;
+    uint32_t max_runs;
+    uint32_t frames;
+    uint32_t run;
+    uint16_t run_frame;
+} movie_t;
+
+typedef struct gameboy_t gameboy_t;
+typedef struct save_writer_t save_writer_t;
+
+struct gameboy_t
+{
+    registers_t registers;
+    state_t state;
+    uint8_t op_cycles;
+    cycles_t cycles;
+    uint8_t *memory;
+    rom_image_t *rom_image;
+    uint8_t *rom;
+    uint8_t *ram;
+    uint8_t *framebuffer;
+    cartridge_header_t *cartridge_header;
+    joypad_t *joypad;
+    lcd_t *lcd;
+    timer_registers_t *timer;
+    interrupt_t *interrupt_e;
+    interrupt_t *interrupt_f;
+    uint8_t *rom_banks[256];
+    uint8_t *ram_banks[8];
+    uint8_t rom_bank;
+    uint8_t ram_bank;
+    uint8_t *rom_page;
+    uint8_t *ram_page;
+    uint8_t *read_pages[256];
+    uint8_t *write_pages[256];
+    uint8_t *const *read_map;
+    uint8_t *const *write_map;
+    uint16_t write_dirty[256];
+    uint8_t dirty[STATE_PAGES];
+    rewind_t rewind;
+    jit_t jit;
+    sprite_attribute_t scanline_sprites[MAX_SCANLINE_SPRITES];
+    uint8_t num_scanline_sprites;
+    uint8_t oam_bins[SCREEN_H][MAX_SCANLINE_SPRITES];
+    uint8_t oam_bin_counts[SCREEN_H];
+    uint8_t oam_bin_size;
+    bool oam_dirty;
+    uint8_t tile_cache[NUM_TILES][8][8];
+    uint8_t tile_dirty[NUM_TILES];
+    uint8_t saved_banks;
+    uint32_t save_delay;
+    apu_t apu;
+    audio_t audio;
+    bool audio_enabled;
+    bool no_save_file;
+    save_writer_t *save_writer;
+    perf_counters_t perf;
+    uint32_t frames;
+    uint32_t render_interval;
+    uint8_t *run_ahead_state;
+    size_t run_ahead_size;
+    uint8_t buttons;
+    void *user;
+    char rom_path[MAX_PATH_LENGTH];
+};
+
+// Every function operates on its own gameboy_t only, so independent instances can be run
+// concurrently from different threads. Shared ROM images are only ever read.
+bool gb_init(gameboy_t *gb);
+void gb_free(gameboy_t *gb);
+bool gb_load(gameboy_t *gb, const char *path);
+
+// gb_rom_load reads and validates a ROM once, gb_load_rom resets an instance to run it. Every
+// instance keeps its own reference, the caller releases the one returned by gb_rom_load. Paths
+// too long to name the save file next to the ROM within MAX_PATH_LENGTH are rejected.
+rom_image_t *gb_rom_load(const char *path);
+void gb_rom_release(rom_image_t *rom);
+bool gb_load_rom(gameboy_t *gb, rom_image_t *rom);
+
+void gb_reset(gameboy_t *gb);
+void gb_save(gameboy_t *gb);
+void gb_autosave(gameboy_t *gb);
+uint32_t gb_step(gameboy_t *gb);
+uint64_t gb_run_frames(gameboy_t *gb, uint32_t count);
+
+// Battery backed cartridge RAM is kept in <rom>.sav. gb_save writes it whenever a bank changed
+// since the last save, replacing the file atomically once the new one is on disk. Hosts that call
+// gb_autosave once per frame get a save shortly after every change instead of only when they call
+// gb_save. Autosaves are written by a background thread from a copy of the RAM, so a slow disk
+// never holds up the emulation; gb_save and gb_free wait for one that is still running. With
+// no_save_file set every reset starts from cleared cartridge RAM and nothing is ever written.
+
+// render_interval selects which frames are drawn into the framebuffer: 1 (the default) draws
+// every frame, N only the frames after which gb->frames is a multiple of N and 0 none at all.
+// The emulation itself, including LCD timing and interrupts, doesn't depend on it.
+
+// gb_run_ahead runs one frame like gb_run_frames, then the given number of frames further with
+// the same buttons and rolls back to the end of the first one. Only the last frame is drawn, and
+// only if render_interval selects the first one, so the framebuffer shows the effect of the
+// buttons that many frames earlier. Up to 4 frames hide the lag most games have between reading
+// the joypad and showing the result.
+uint64_t gb_run_ahead(gameboy_t *gb, uint32_t frames);
+
+// gb_jit_init switches an instance to the recompiler, which exists on x86-64 unless the core is
+// built with NO_JIT. Straight line code in ROM, work RAM and high RAM that runs often is
+// translated into a native sequence of calls to the instruction handlers, saving the fetch and
+// dispatch of every instruction. Interrupts, events and memory accesses are checked after every
+// instruction exactly like in the interpreter, so the emulation stays identical. Writes to RAM
+// holding translated code drop the affected blocks. Returns false where the recompiler isn't
+// available, the instance then keeps interpreting.
+bool gb_jit_init(gameboy_t *gb);
+
+// With audio_enabled set the APU output is resampled to AUDIO_SAMPLE_RATE and queued as
+// interleaved 16 bit stereo frames at the end of every emulated frame. gb_audio_read takes up to
+// count frames from the queue and can be called from another thread without any locking,
+// gb_audio_queued returns how many are waiting. When the host falls behind, new frames are
+// dropped. The emulation itself doesn't depend on audio_enabled.
+uint32_t gb_audio_read(gameboy_t *gb, int16_t *samples, uint32_t count);
+uint32_t gb_audio_queued(gameboy_t *gb);
+
+// Converts the framebuffer to SCREEN_W*SCREEN_H ARGB pixels using the four given shade colors,
+// or the default green palette when colors is NULL.
+void gb_present(gameboy_t *gb, uint32_t *pixels, const uint32_t *colors);
+
+// Save states are written to and read from caller provided buffers of gb_state_size() bytes.
+// They are tied to the loaded ROM and to the build that wrote them.
+size_t gb_state_size(gameboy_t *gb);
+size_t gb_save_state(gameboy_t *gb, void *buffer, size_t size);
+bool gb_load_state(gameboy_t *gb, const void *buffer, size_t size);
+
+// Rewind keeps a ring buffer of snapshots. Only the 256 byte pages written since the previous
+// snapshot are stored, so pushing one snapshot per frame stays cheap. gb_rewind_pop restores the
+// most recent snapshot and discards it, the oldest snapshots are dropped when the ring is full.
+bool gb_rewind_init(gameboy_t *gb, uint32_t capacity);
+void gb_rewind_push(gameboy_t *gb);
+bool gb_rewind_pop(gameboy_t *gb);
+uint32_t gb_rewind_count(gameboy_t *gb);
+
+// gb_perf_dump writes the counters collected since the last gb_perf_reset as text (the busiest
+// opcodes only) or as a JSON object with everything.
+bool gb_perf_enabled(void);
+void gb_perf_reset(gameboy_t *gb);
+void gb_perf_dump(gameboy_t *gb, FILE *file, bool json);
+
+// Hash of the complete machine state, equal for two runs that went through the same states.
+uint64_t gb_state_hash(gameboy_t *gb);
+
+// A movie is the sequence of button masks (button_e) the host set for every frame since reset.
+// Playing it back on the same ROM reproduces a recorded run exactly.
+bool gb_movie_record(movie_t *movie, uint8_t buttons);
+bool gb_movie_play(movie_t *movie, uint8_t *buttons);
+bool gb_movie_save(movie_t *movie, gameboy_t *gb, const char *path);
+bool gb_movie_load(movie_t *movie, gameboy_t *gb, const char *path);
+void gb_movie_free(movie_t *movie);
+
+#endif
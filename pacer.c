@@ -0,0 +1,167 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "pacer.h"
+
+#include <string.h>
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x2
+#endif
+
+uint64_t pacer_time(void)
+{
+    static LARGE_INTEGER frequency;
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    uint64_t seconds = (uint64_t)(ticks.QuadPart/frequency.QuadPart);
+    uint64_t rest = (uint64_t)(ticks.QuadPart%frequency.QuadPart);
+    uint64_t result = seconds*1000000000 + (rest*1000000000)/(uint64_t)frequency.QuadPart;
+    return(result);
+}
+
+static void *create_timer(void)
+{
+    // High resolution timers exist since Windows 10 1803, before that the sleep is only good
+    // to about a millisecond and the rest is spent spinning.
+    HANDLE timer = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    return(timer);
+}
+
+static void free_timer(void *timer)
+{
+    if(timer)
+        CloseHandle(timer);
+}
+
+static void sleep_until(pacer_t *pacer, uint64_t deadline)
+{
+    uint64_t now = pacer_time();
+    uint64_t slack = (pacer->timer ? 0 : 2000000);
+    if(deadline > now + slack)
+    {
+        uint64_t duration = deadline - now - slack;
+        if(pacer->timer)
+        {
+            LARGE_INTEGER due = { .QuadPart = -(LONGLONG)(duration/100) };
+            if(SetWaitableTimer(pacer->timer, &due, 0, NULL, NULL, FALSE))
+                WaitForSingleObject(pacer->timer, INFINITE);
+        }
+        else
+        {
+            Sleep((DWORD)(duration/1000000));
+        }
+    }
+    while(pacer_time() < deadline)
+        Sleep(0);
+}
+
+#else
+
+#include <time.h>
+#include <errno.h>
+
+uint64_t pacer_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t result = (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+    return(result);
+}
+
+static void *create_timer(void)
+{
+    return(NULL);
+}
+
+static void free_timer(void *timer)
+{
+}
+
+static void sleep_until(pacer_t *pacer, uint64_t deadline)
+{
+    struct timespec ts = { .tv_sec = (time_t)(deadline/1000000000), .tv_nsec = (long)(deadline%1000000000) };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        continue;
+}
+
+#endif
+
+void pacer_init(pacer_t *pacer, uint64_t period)
+{
+    memset(pacer, 0, sizeof(pacer_t));
+    pacer->period = period;
+    pacer->timer = create_timer();
+    pacer->last_frame = pacer_time();
+    pacer->deadline = pacer->last_frame + period;
+}
+
+void pacer_free(pacer_t *pacer)
+{
+    free_timer(pacer->timer);
+    pacer->timer = NULL;
+}
+
+void pacer_wait(pacer_t *pacer)
+{
+    uint64_t now = pacer_time();
+    if(now > pacer->deadline)
+    {
+        pacer->missed += 1;
+        if(now - pacer->deadline > pacer->period)
+            pacer->deadline = now;
+    }
+    sleep_until(pacer, pacer->deadline);
+
+    now = pacer_time();
+    uint64_t interval = now - pacer->last_frame;
+    uint64_t bucket = interval/PACER_BUCKET_NS;
+    pacer->histogram[(bucket < PACER_BUCKETS) ? bucket : (PACER_BUCKETS - 1)] += 1;
+    pacer->max_interval = ((interval > pacer->max_interval) ? interval : pacer->max_interval);
+    pacer->frames += 1;
+    pacer->last_frame = now;
+    pacer->deadline += pacer->period;
+}
+
+uint64_t pacer_period(uint32_t refresh_rate)
+{
+    uint64_t period = PACER_GB_PERIOD;
+    if(refresh_rate > 0)
+    {
+        uint64_t host_period = 1000000000/refresh_rate;
+        if(host_period*100 >= period*98 && host_period*100 <= period*102)
+            period = host_period;
+    }
+    return(period);
+}
+
+uint64_t pacer_percentile(pacer_t *pacer, double percentile)
+{
+    // Returns the upper end of the bucket the percentile falls into.
+    uint64_t target = (uint64_t)(percentile*pacer->frames/100.0);
+    uint64_t count = 0;
+    uint32_t bucket = 0;
+    for(; bucket < PACER_BUCKETS - 1; bucket++)
+    {
+        count += pacer->histogram[bucket];
+        if(count > target)
+            break;
+    }
+    uint64_t result = (uint64_t)(bucket + 1)*PACER_BUCKET_NS;
+    return(result);
+}
+
+void pacer_print(pacer_t *pacer, FILE *file)
+{
+    fprintf(file, "pace:    %.3f ms target, p50 %.1f ms, p99 %.1f ms, max %.3f ms, %llu of %llu deadlines missed\n",
+        pacer->period/1e6, pacer_percentile(pacer, 50.0)/1e6, pacer_percentile(pacer, 99.0)/1e6,
+        pacer->max_interval/1e6, (unsigned long long)pacer->missed, (unsigned long long)pacer->frames);
+}
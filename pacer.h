@@ -0,0 +1,45 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// The histogram holds the intervals between consecutive frames in 0.1 ms buckets, the last
+// bucket collects everything longer.
+#define PACER_BUCKETS 512
+#define PACER_BUCKET_NS 100000
+
+typedef struct pacer_t
+{
+    uint64_t period;
+    uint64_t deadline;
+    uint64_t last_frame;
+    uint64_t frames;
+    uint64_t missed;
+    uint64_t max_interval;
+    uint32_t histogram[PACER_BUCKETS];
+    void *timer;
+} pacer_t;
+
+// Length of a frame of the original hardware in nanoseconds.
+#define PACER_GB_PERIOD (1000000000ull*70224/4194304)
+
+uint64_t pacer_time(void);
+
+// pacer_wait sleeps until the absolute deadline of the next frame, deadlines advance by exactly
+// one period so sleep inaccuracies never accumulate. A frame that ends after its deadline counts
+// as missed. One that is late by more than a whole period also restarts the schedule from now
+// instead of rushing through the following frames to catch up.
+void pacer_init(pacer_t *pacer, uint64_t period);
+void pacer_free(pacer_t *pacer);
+void pacer_wait(pacer_t *pacer);
+
+// Picks the host refresh period when it is within 2% of the original frame rate, which avoids
+// a frame being presented twice or not at all every few seconds.
+uint64_t pacer_period(uint32_t refresh_rate);
+
+uint64_t pacer_percentile(pacer_t *pacer, double percentile);
+void pacer_print(pacer_t *pacer, FILE *file);
+
+#endif
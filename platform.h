@@ -0,0 +1,282 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+// Minimal platform layer: threads and atomics for the frontends and tools that run emulation on
+// several threads, read only file mappings for the ROMs, durable writes and atomic file
+// replacement for the battery saves and executable memory for the recompiler.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+
+#define THREAD_PROC(name) DWORD WINAPI name(void *data)
+
+static inline bool thread_create(thread_t *thread, LPTHREAD_START_ROUTINE proc, void *data)
+{
+    *thread = CreateThread(NULL, 0, proc, data, 0, NULL);
+    return(*thread != NULL);
+}
+
+static inline void thread_join(thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static inline void mutex_init(mutex_t *mutex)
+{
+    InitializeCriticalSection(mutex);
+}
+
+static inline void mutex_free(mutex_t *mutex)
+{
+    DeleteCriticalSection(mutex);
+}
+
+static inline void mutex_lock(mutex_t *mutex)
+{
+    EnterCriticalSection(mutex);
+}
+
+static inline void mutex_unlock(mutex_t *mutex)
+{
+    LeaveCriticalSection(mutex);
+}
+
+// The atomics are sequentially consistent, which is all the lock-free queues here need.
+static inline uint32_t atomic_load_u32(volatile uint32_t *value)
+{
+    uint32_t result = (uint32_t)InterlockedCompareExchange((volatile LONG *)value, 0, 0);
+    return(result);
+}
+
+static inline void atomic_store_u32(volatile uint32_t *value, uint32_t new_value)
+{
+    InterlockedExchange((volatile LONG *)value, (LONG)new_value);
+}
+
+static inline uint32_t atomic_exchange_u32(volatile uint32_t *value, uint32_t new_value)
+{
+    uint32_t result = (uint32_t)InterlockedExchange((volatile LONG *)value, (LONG)new_value);
+    return(result);
+}
+
+static inline uint32_t cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return(info.dwNumberOfProcessors);
+}
+
+static inline uint8_t *map_file(const char *path, uint32_t *size)
+{
+    uint8_t *result = NULL;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER file_size;
+        if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && file_size.QuadPart <= UINT32_MAX)
+        {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if(mapping)
+            {
+                // The view keeps the mapping alive after its handle is closed.
+                result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                *size = (uint32_t)file_size.QuadPart;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+    return(result);
+}
+
+static inline void unmap_file(uint8_t *data, uint32_t size)
+{
+    UnmapViewOfFile(data);
+}
+
+// write_file only succeeds once the data reached the disk, so replacing another file with it
+// afterwards can't leave an empty or truncated file behind after a power loss.
+static inline bool write_file(const char *path, const void *data, uint32_t size)
+{
+    bool result = false;
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file != INVALID_HANDLE_VALUE)
+    {
+        DWORD written = 0;
+        result = (WriteFile(file, data, size, &written, NULL) && written == size && FlushFileBuffers(file));
+        result = (CloseHandle(file) && result);
+    }
+    return(result);
+}
+
+static inline bool replace_file(const char *from, const char *to)
+{
+    bool result = (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0);
+    return(result);
+}
+
+static inline uint8_t *alloc_code(uint32_t size)
+{
+    uint8_t *result = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    return(result);
+}
+
+static inline void free_code(uint8_t *code, uint32_t size)
+{
+    VirtualFree(code, 0, MEM_RELEASE);
+}
+
+#else
+
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+
+#define THREAD_PROC(name) void *name(void *data)
+
+static inline bool thread_create(thread_t *thread, void *(*proc)(void *), void *data)
+{
+    bool result = (pthread_create(thread, NULL, proc, data) == 0);
+    return(result);
+}
+
+static inline void thread_join(thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+static inline void mutex_init(mutex_t *mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static inline void mutex_free(mutex_t *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static inline void mutex_lock(mutex_t *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static inline void mutex_unlock(mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static inline uint32_t atomic_load_u32(volatile uint32_t *value)
+{
+    uint32_t result = __atomic_load_n(value, __ATOMIC_SEQ_CST);
+    return(result);
+}
+
+static inline void atomic_store_u32(volatile uint32_t *value, uint32_t new_value)
+{
+    __atomic_store_n(value, new_value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_exchange_u32(volatile uint32_t *value, uint32_t new_value)
+{
+    uint32_t result = __atomic_exchange_n(value, new_value, __ATOMIC_SEQ_CST);
+    return(result);
+}
+
+static inline uint32_t cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return((count > 0) ? (uint32_t)count : 1);
+}
+
+static inline uint8_t *map_file(const char *path, uint32_t *size)
+{
+    uint8_t *result = NULL;
+    int file = open(path, O_RDONLY);
+    if(file >= 0)
+    {
+        struct stat info;
+        if(fstat(file, &info) == 0 && info.st_size > 0 && info.st_size <= UINT32_MAX)
+        {
+            void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+            if(data != MAP_FAILED)
+            {
+                result = data;
+                *size = (uint32_t)info.st_size;
+            }
+        }
+        close(file);
+    }
+    return(result);
+}
+
+static inline void unmap_file(uint8_t *data, uint32_t size)
+{
+    munmap(data, size);
+}
+
+static inline bool write_file(const char *path, const void *data, uint32_t size)
+{
+    bool result = false;
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(file >= 0)
+    {
+        const uint8_t *bytes = data;
+        uint32_t written = 0;
+        while(written < size)
+        {
+            ssize_t count = write(file, bytes + written, size - written);
+            if(count <= 0)
+                break;
+            written += (uint32_t)count;
+        }
+        result = (written == size && fsync(file) == 0);
+        result = ((close(file) == 0) && result);
+    }
+    return(result);
+}
+
+static inline bool replace_file(const char *from, const char *to)
+{
+    bool result = (rename(from, to) == 0);
+    return(result);
+}
+
+// Anonymous mappings aren't part of POSIX, a private mapping of /dev/zero is the portable way.
+// Systems that refuse writable and executable pages return NULL.
+static inline uint8_t *alloc_code(uint32_t size)
+{
+    uint8_t *result = NULL;
+    int file = open("/dev/zero", O_RDWR);
+    if(file >= 0)
+    {
+        void *data = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE, file, 0);
+        if(data != MAP_FAILED)
+            result = data;
+        close(file);
+    }
+    return(result);
+}
+
+static inline void free_code(uint8_t *code, uint32_t size)
+{
+    munmap(code, size);
+}
+
+#endif
+
+#endif
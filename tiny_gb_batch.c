@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "gb.h"
+#include "platform.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef enum job_status_e
+{
+    JOB_STATUS_PENDING,
+    JOB_STATUS_OK,
+    JOB_STATUS_FAILED,
+    JOB_STATUS_ERROR,
+} job_status_e;
+
+typedef struct job_t
+{
+    char rom_path[MAX_PATH_LENGTH];
+    char movie_path[MAX_PATH_LENGTH];
+    rom_image_t *rom;
+    uint32_t frames;
+    bool check;
+    uint64_t expected;
+    job_status_e status;
+    uint64_t hash;
+    uint64_t cycles;
+    double seconds;
+} job_t;
+
+// Every worker owns a range of jobs, takes them from the front and steals from the back of
+// the other workers' ranges once its own is done.
+typedef struct queue_t
+{
+    mutex_t mutex;
+    uint32_t head;
+    uint32_t tail;
+} queue_t;
+
+typedef struct batch_t batch_t;
+
+typedef struct worker_t
+{
+    batch_t *batch;
+    uint32_t index;
+    thread_t thread;
+} worker_t;
+
+struct batch_t
+{
+    job_t *jobs;
+    uint32_t num_jobs;
+    rom_image_t **roms;
+    uint32_t num_roms;
+    queue_t *queues;
+    worker_t *workers;
+    uint32_t num_workers;
+    uint32_t render_interval;
+    bool jit;
+};
+
+static double seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    double result = (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+    return(result);
+}
+
+static bool parse_field(const char *field)
+{
+    bool result = (strcmp(field, "-") != 0);
+    return(result);
+}
+
+static bool load_manifest(const char *path, job_t **manifest, uint32_t *num_jobs)
+{
+    // One job per line: <rom> <frames> [<movie>|-] [<expected state hash>|-]
+    // A frame count of 0 runs the whole movie. Empty lines and lines starting with # are ignored.
+    // The fields are read into buffers as long as the line, paths too long for the core (ROMs
+    // need room for the save file name next to them) fail the whole manifest.
+    FILE *file = fopen(path, "r");
+    if(!file)
+        return(false);
+
+    job_t *jobs = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    uint32_t line_number = 0;
+    char line[4*MAX_PATH_LENGTH];
+    while(fgets(line, sizeof(line), file))
+    {
+        char rom_path[sizeof(line)] = { 0 };
+        char movie_path[sizeof(line)] = { 0 };
+        char hash[32] = { 0 };
+        unsigned long frames = 0;
+        line_number += 1;
+        int fields = sscanf(line, "%1039s %lu %1039s %31s", rom_path, &frames, movie_path, hash);
+        if(fields < 1 || rom_path[0] == '#')
+            continue;
+
+        if(strlen(rom_path) + sizeof(".sav.tmp") > MAX_PATH_LENGTH || strlen(movie_path) >= MAX_PATH_LENGTH)
+        {
+            fprintf(stderr, "%s:%u: path too long\n", path, line_number);
+            free(jobs);
+            fclose(file);
+            return(false);
+        }
+
+        if(count == capacity)
+        {
+            capacity = 64 + 2*capacity;
+            job_t *resized = realloc(jobs, capacity*sizeof(job_t));
+            if(!resized)
+            {
+                free(jobs);
+                fclose(file);
+                return(false);
+            }
+            jobs = resized;
+        }
+
+        job_t *job = &jobs[count++];
+        *job = (job_t){ .frames = (uint32_t)frames };
+        strcpy(job->rom_path, rom_path);
+        if(fields >= 3 && parse_field(movie_path))
+            strcpy(job->movie_path, movie_path);
+        if(fields >= 4 && parse_field(hash))
+        {
+            job->check = true;
+            job->expected = strtoull(hash, NULL, 16);
+        }
+    }
+    fclose(file);
+
+    *manifest = jobs;
+    *num_jobs = count;
+    return(true);
+}
+
+static bool load_roms(batch_t *batch)
+{
+    // Every ROM is read once, all jobs and workers running it share the same image.
+    batch->roms = calloc(MAX(batch->num_jobs, 1), sizeof(rom_image_t *));
+    if(!batch->roms)
+        return(false);
+
+    for(uint32_t i = 0; i < batch->num_jobs; i++)
+    {
+        job_t *job = &batch->jobs[i];
+        for(uint32_t j = 0; !job->rom && j < batch->num_roms; j++)
+        {
+            if(strcmp(batch->roms[j]->path, job->rom_path) == 0)
+                job->rom = batch->roms[j];
+        }
+        if(!job->rom)
+        {
+            job->rom = gb_rom_load(job->rom_path);
+            if(job->rom)
+                batch->roms[batch->num_roms++] = job->rom;
+        }
+    }
+    return(true);
+}
+
+static bool take_job(batch_t *batch, uint32_t worker, uint32_t *job)
+{
+    bool result = false;
+    queue_t *queue = &batch->queues[worker];
+    mutex_lock(&queue->mutex);
+    if(queue->head < queue->tail)
+    {
+        *job = queue->head++;
+        result = true;
+    }
+    mutex_unlock(&queue->mutex);
+
+    for(uint32_t i = 1; !result && i < batch->num_workers; i++)
+    {
+        queue_t *victim = &batch->queues[(worker + i) % batch->num_workers];
+        mutex_lock(&victim->mutex);
+        if(victim->head < victim->tail)
+        {
+            *job = --victim->tail;
+            result = true;
+        }
+        mutex_unlock(&victim->mutex);
+    }
+    return(result);
+}
+
+static void run_job(gameboy_t *gb, job_t *job, uint32_t render_interval)
+{
+    movie_t movie = { 0 };
+    if(!job->rom || !gb_load_rom(gb, job->rom) || (job->movie_path[0] && !gb_movie_load(&movie, gb, job->movie_path)))
+    {
+        job->status = JOB_STATUS_ERROR;
+        return;
+    }
+
+    gb->render_interval = render_interval;
+    gb->buttons = 0;
+    if(job->frames == 0)
+        job->frames = (job->movie_path[0] ? movie.frames : 600);
+
+    double start = seconds();
+    for(uint32_t i = 0; i < job->frames; i++)
+    {
+        if(!gb_movie_play(&movie, &gb->buttons))
+            gb->buttons = 0;
+        job->cycles += gb_run_frames(gb, 1);
+    }
+    job->seconds = seconds() - start;
+
+    job->hash = gb_state_hash(gb);
+    job->status = ((!job->check || job->hash == job->expected) ? JOB_STATUS_OK : JOB_STATUS_FAILED);
+    gb_movie_free(&movie);
+}
+
+static THREAD_PROC(worker_proc)
+{
+    worker_t *worker = data;
+    batch_t *batch = worker->batch;
+
+    // Every worker reuses its own emulator context for all the jobs it runs. Jobs start from
+    // cleared cartridge RAM, so their hashes don't depend on whatever save is next to the ROM.
+    gameboy_t gb;
+    if(gb_init(&gb))
+    {
+        gb.no_save_file = true;
+        if(batch->jit)
+            gb_jit_init(&gb);
+        uint32_t job = 0;
+        while(take_job(batch, worker->index, &job))
+            run_job(&gb, &batch->jobs[job], batch->render_interval);
+        gb_free(&gb);
+    }
+    return(0);
+}
+
+int main(int argc, char **argv)
+{
+    char *manifest_path = NULL;
+    uint32_t num_workers = cpu_count();
+    uint32_t render_interval = 0;
+    bool jit = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--threads") == 0 && (i + 1) < argc)
+            num_workers = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--render") == 0 && (i + 1) < argc)
+            render_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--jit") == 0)
+            jit = true;
+        else
+            manifest_path = argv[i];
+    }
+
+    if(!manifest_path)
+    {
+        fprintf(stderr, "usage: %s <manifest> [--threads <count>] [--render <interval>] [--jit]\n", argv[0]);
+        fprintf(stderr, "manifest lines: <rom> <frames> [<movie>|-] [<expected state hash>|-]\n");
+        return(1);
+    }
+
+    batch_t batch = { .render_interval = render_interval, .jit = jit };
+    if(!load_manifest(manifest_path, &batch.jobs, &batch.num_jobs))
+    {
+        fprintf(stderr, "failed to read manifest '%s'\n", manifest_path);
+        return(1);
+    }
+
+    batch.num_workers = MAX(MIN(num_workers, batch.num_jobs), 1);
+    batch.queues = calloc(batch.num_workers, sizeof(queue_t));
+    batch.workers = calloc(batch.num_workers, sizeof(worker_t));
+    if(!batch.queues || !batch.workers || !load_roms(&batch))
+    {
+        fprintf(stderr, "failed to allocate workers\n");
+        return(1);
+    }
+
+    double start = seconds();
+    for(uint32_t i = 0; i < batch.num_workers; i++)
+    {
+        queue_t *queue = &batch.queues[i];
+        mutex_init(&queue->mutex);
+        queue->head = (uint32_t)(((uint64_t)batch.num_jobs*i)/batch.num_workers);
+        queue->tail = (uint32_t)(((uint64_t)batch.num_jobs*(i + 1))/batch.num_workers);
+    }
+    uint32_t num_threads = 0;
+    for(uint32_t i = 0; i < batch.num_workers; i++)
+    {
+        worker_t *worker = &batch.workers[i];
+        *worker = (worker_t){ .batch = &batch, .index = i };
+        if(thread_create(&worker->thread, worker_proc, worker))
+            num_threads += 1;
+        else
+            break;
+    }
+    for(uint32_t i = 0; i < num_threads; i++)
+        thread_join(batch.workers[i].thread);
+    double elapsed = seconds() - start;
+
+    const char *status_names[] = { "SKIPPED", "ok", "FAILED", "ERROR" };
+    uint32_t counts[4] = { 0 };
+    uint64_t frames = 0;
+    uint64_t cycles = 0;
+    for(uint32_t i = 0; i < batch.num_jobs; i++)
+    {
+        job_t *job = &batch.jobs[i];
+        counts[job->status] += 1;
+        frames += job->frames;
+        cycles += job->cycles;
+        printf("%-7s %016llx %8u frames %8.3f s  %s", status_names[job->status], (unsigned long long)job->hash, job->frames, job->seconds, job->rom_path);
+        if(job->movie_path[0])
+            printf(" %s", job->movie_path);
+        if(job->status == JOB_STATUS_FAILED)
+            printf(" (expected %016llx)", (unsigned long long)job->expected);
+        printf("\n");
+    }
+
+    printf("jobs:    %u ok, %u failed, %u errors, %u skipped\n", counts[JOB_STATUS_OK], counts[JOB_STATUS_FAILED], counts[JOB_STATUS_ERROR], counts[JOB_STATUS_PENDING]);
+    printf("threads: %u\n", num_threads);
+    printf("frames:  %llu\n", (unsigned long long)frames);
+    printf("time:    %.3f s\n", elapsed);
+    printf("fps:     %.1f\n", frames/elapsed);
+    printf("speed:   %.1fx\n", ((double)cycles/CLOCK_FREQUENCY)/elapsed);
+
+    for(uint32_t i = 0; i < batch.num_workers; i++)
+        mutex_free(&batch.queues[i].mutex);
+    for(uint32_t i = 0; i < batch.num_roms; i++)
+        gb_rom_release(batch.roms[i]);
+    free(batch.roms);
+    free(batch.queues);
+    free(batch.workers);
+    free(batch.jobs);
+
+    return((counts[JOB_STATUS_OK] == batch.num_jobs) ? 0 : 1);
+}
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "gb.h"
+#include "pacer.h"
+
+static double seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    double result = (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+    return(result);
+}
+
+static uint64_t framebuffer_hash(gameboy_t *gb)
+{
+    // FNV-1a over the final frame, handy to compare runs across builds.
+    uint64_t hash = 0xCBF29CE484222325;
+    uint8_t *bytes = gb->framebuffer;
+    for(uint32_t i = 0; i < SCREEN_W*SCREEN_H; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+    return(hash);
+}
+
+static void write_u32(FILE *file, uint32_t value)
+{
+    uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    fwrite(bytes, 1, 4, file);
+}
+
+static void write_wav_header(FILE *file, uint32_t frames)
+{
+    // 16 bit stereo PCM, the sizes are patched in once all frames are written.
+    uint32_t data_size = frames*4;
+    fwrite("RIFF", 1, 4, file);
+    write_u32(file, 36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, file);
+    write_u32(file, 16);
+    write_u32(file, 0x00020001);
+    write_u32(file, AUDIO_SAMPLE_RATE);
+    write_u32(file, AUDIO_SAMPLE_RATE*4);
+    write_u32(file, 0x00100004);
+    fwrite("data", 1, 4, file);
+    write_u32(file, data_size);
+}
+
+static uint32_t write_audio(gameboy_t *gb, FILE *file)
+{
+    // Samples are little endian in WAV files, which every supported host is as well.
+    int16_t samples[2*1024];
+    uint32_t frames = 0;
+    uint32_t count = 0;
+    while((count = gb_audio_read(gb, samples, 1024)) > 0)
+    {
+        fwrite(samples, 4, count, file);
+        frames += count;
+    }
+    return(frames);
+}
+
+int main(int argc, char **argv)
+{
+    char *rom_path = NULL;
+    char *movie_path = NULL;
+    char *wav_path = NULL;
+    uint32_t frames = 0;
+    uint32_t render_interval = 1;
+    bool perf = false;
+    bool perf_json = false;
+    uint32_t perf_interval = 0;
+    bool pace = false;
+    double max_p99 = 0.0;
+    long max_missed = -1;
+    uint32_t run_ahead = 0;
+    bool jit = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--movie") == 0 && (i + 1) < argc)
+            movie_path = argv[++i];
+        else if(strcmp(argv[i], "--render") == 0 && (i + 1) < argc)
+            render_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--wav") == 0 && (i + 1) < argc)
+            wav_path = argv[++i];
+        else if(strcmp(argv[i], "--run-ahead") == 0 && (i + 1) < argc)
+            run_ahead = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--pace") == 0)
+            pace = true;
+        else if(strcmp(argv[i], "--max-p99") == 0 && (i + 1) < argc)
+        {
+            pace = true;
+            max_p99 = strtod(argv[++i], NULL);
+        }
+        else if(strcmp(argv[i], "--max-missed") == 0 && (i + 1) < argc)
+        {
+            pace = true;
+            max_missed = strtol(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--jit") == 0)
+            jit = true;
+        else if((strcmp(argv[i], "--perf") == 0 || strcmp(argv[i], "--perf-json") == 0) && (i + 1) < argc)
+        {
+            perf = true;
+            perf_json = (strcmp(argv[i], "--perf-json") == 0);
+            perf_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(!rom_path)
+            rom_path = argv[i];
+        else
+            frames = (uint32_t)strtoul(argv[i], NULL, 10);
+    }
+
+    if(!rom_path)
+    {
+        fprintf(stderr, "usage: %s <rom> [frames] [--movie <movie>] [--render <interval>] [--perf|--perf-json <interval>] [--run-ahead <frames>] [--wav <file>] [--pace] [--max-p99 <ms>] [--max-missed <frames>] [--jit]\n", argv[0]);
+        return(1);
+    }
+
+    gameboy_t gb;
+    if(!gb_init(&gb))
+    {
+        fprintf(stderr, "failed to allocate emulator memory\n");
+        return(1);
+    }
+
+    // Replays start from cleared cartridge RAM like in the batch runner, so their hashes don't
+    // depend on the save next to the ROM, and never write one.
+    gb.no_save_file = (movie_path != NULL);
+    if(!gb_load(&gb, rom_path))
+    {
+        fprintf(stderr, "failed to load rom '%s'\n", rom_path);
+        return(1);
+    }
+
+    gb.render_interval = render_interval;
+
+    movie_t movie = { 0 };
+    if(movie_path && !gb_movie_load(&movie, &gb, movie_path))
+    {
+        fprintf(stderr, "failed to load movie '%s'\n", movie_path);
+        return(1);
+    }
+    if(frames == 0)
+        frames = (movie_path ? movie.frames : 600);
+    if(perf && !gb_perf_enabled())
+    {
+        fprintf(stderr, "performance counters are not available, build with GB_PERF_COUNTERS\n");
+        perf = false;
+    }
+    if(jit && !gb_jit_init(&gb))
+        fprintf(stderr, "the recompiler is not available, interpreting\n");
+
+    // With --wav the sound is written to a file instead of a sound device.
+    FILE *wav = NULL;
+    uint32_t wav_frames = 0;
+    if(wav_path)
+    {
+        wav = fopen(wav_path, "wb");
+        if(!wav)
+        {
+            fprintf(stderr, "failed to create '%s'\n", wav_path);
+            return(1);
+        }
+        write_wav_header(wav, 0);
+        gb.audio_enabled = true;
+    }
+
+    // With --pace the frames run in real time like in the windowed frontend.
+    pacer_t pacer;
+    if(pace)
+        pacer_init(&pacer, PACER_GB_PERIOD);
+
+    double start = seconds();
+    uint64_t cycles = 0;
+    for(uint32_t i = 0; i < frames; i++)
+    {
+        // Once the movie is over the buttons are released.
+        if(!gb_movie_play(&movie, &gb.buttons))
+            gb.buttons = 0;
+        cycles += gb_run_ahead(&gb, run_ahead);
+        if(wav)
+            wav_frames += write_audio(&gb, wav);
+        if(pace)
+            pacer_wait(&pacer);
+
+        // The counters are dumped to stderr every perf_interval frames, or once at the end.
+        if(perf && ((perf_interval && ((i + 1) % perf_interval) == 0) || (i + 1) == frames))
+        {
+            gb_perf_dump(&gb, stderr, perf_json);
+            gb_perf_reset(&gb);
+        }
+    }
+    double elapsed = seconds() - start;
+
+    double emulated = (double)cycles/CLOCK_FREQUENCY;
+    printf("frames:  %u\n", frames);
+    printf("cycles:  %llu\n", (unsigned long long)cycles);
+    printf("time:    %.3f s\n", elapsed);
+    printf("fps:     %.1f\n", frames/elapsed);
+    printf("speed:   %.1fx\n", emulated/elapsed);
+    printf("hash:    %016llx\n", (unsigned long long)framebuffer_hash(&gb));
+    printf("state:   %016llx\n", (unsigned long long)gb_state_hash(&gb));
+    // The pacing limits make the run fail, so a regression in the frame timing breaks a CI job.
+    int result = 0;
+    if(pace)
+    {
+        pacer_print(&pacer, stdout);
+        uint64_t p99 = pacer_percentile(&pacer, 99.0);
+        if(max_p99 > 0.0 && p99 > (uint64_t)(max_p99*1e6))
+        {
+            fprintf(stderr, "p99 frame time %.1f ms exceeds the limit of %.1f ms\n", p99/1e6, max_p99);
+            result = 1;
+        }
+        if(max_missed >= 0 && pacer.missed > (uint64_t)max_missed)
+        {
+            fprintf(stderr, "%llu missed deadlines exceed the limit of %ld\n", (unsigned long long)pacer.missed, max_missed);
+            result = 1;
+        }
+        pacer_free(&pacer);
+    }
+    if(wav)
+    {
+        printf("audio:   %u frames, %.3f s\n", wav_frames, (double)wav_frames/AUDIO_SAMPLE_RATE);
+        fseek(wav, 0, SEEK_SET);
+        write_wav_header(wav, wav_frames);
+        fclose(wav);
+    }
+
+    gb_save(&gb);
+    gb_movie_free(&movie);
+    gb_free(&gb);
+
+    return(result);
+}